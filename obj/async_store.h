@@ -0,0 +1,162 @@
+// Copyright 2016 Aether authors. All Rights Reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//   http://www.apache.org/licenses/LICENSE-2.0
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef AETHER_ASYNC_STORE_H_
+#define AETHER_ASYNC_STORE_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "obj.h"
+
+namespace aether {
+
+// Stores class states on the writer thread so the serializing thread doesn't
+// wait for the storage. Serialization copies each state into the bounded queue
+// and blocks only while the queue is full. The writer thread takes all queued
+// states at once and commits them with a single call of the batch writer, so
+// the writer makes a batch durable once (e.g. a single fsync).
+class AsyncStore {
+ public:
+  struct State {
+    ObjId obj_id;
+    uint32_t class_id;
+    std::vector<uint8_t> data;
+  };
+  // Called on the writer thread. A thrown exception fails the flushes waiting
+  // for the batch.
+  using BatchWriter = std::function<void(std::vector<State>& batch)>;
+
+  explicit AsyncStore(BatchWriter writer, size_t capacity = 4096)
+      : writer_(std::move(writer)), capacity_(capacity) {
+    thread_ = std::thread([this]() { Run(); });
+  }
+  AsyncStore(const AsyncStore&) = delete;
+  AsyncStore& operator=(const AsyncStore&) = delete;
+  // All queued states are written before the thread is stopped.
+  ~AsyncStore() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    not_empty_.notify_one();
+    thread_.join();
+  }
+
+  // The store must outlive the serializations of the domain.
+  void Attach(Domain& domain) {
+    domain.store_buffers_facility_ =
+        [this](const Domain&, const ObjId& obj_id, uint32_t class_id,
+               const std::vector<segment>& buffers) {
+          Push(obj_id, class_id, buffers);
+        };
+  }
+
+  // Can be called from multiple threads.
+  void Push(const ObjId& obj_id, uint32_t class_id,
+            const std::vector<segment>& buffers) {
+    State state{obj_id, class_id, {}};
+    size_t size = 0;
+    for (const auto& b : buffers) size += b.size;
+    state.data.reserve(size);
+    for (const auto& b : buffers) {
+      state.data.insert(state.data.end(), static_cast<const uint8_t*>(b.data),
+                        static_cast<const uint8_t*>(b.data) + b.size);
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this]() { return queue_.size() < capacity_; });
+    queue_.push_back(std::move(state));
+    pushed_++;
+    lock.unlock();
+    not_empty_.notify_one();
+  }
+
+  // Completes when all states pushed before are written. The exception of the
+  // batch writer is rethrown by the flushes completed first after it.
+  std::future<void> Flush() {
+    std::promise<void> promise;
+    auto future = promise.get_future();
+    std::lock_guard<std::mutex> lock(mutex_);
+    flushes_.emplace_back(pushed_, std::move(promise));
+    Complete();
+    return future;
+  }
+
+ private:
+  void Run() {
+    std::vector<State> batch;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      not_empty_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) return;
+      batch.assign(std::make_move_iterator(queue_.begin()),
+                   std::make_move_iterator(queue_.end()));
+      queue_.clear();
+      lock.unlock();
+      not_full_.notify_all();
+      std::exception_ptr error;
+      try {
+        writer_(batch);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      const size_t count = batch.size();
+      batch.clear();
+      lock.lock();
+      written_ += count;
+      if (error && !error_) error_ = error;
+      Complete();
+    }
+  }
+
+  // Called with the lock held.
+  void Complete() {
+    bool completed = false;
+    while (!flushes_.empty() && flushes_.front().first <= written_) {
+      if (error_) {
+        flushes_.front().second.set_exception(error_);
+      } else {
+        flushes_.front().second.set_value();
+      }
+      flushes_.pop_front();
+      completed = true;
+    }
+    if (completed) error_ = nullptr;
+  }
+
+  BatchWriter writer_;
+  const size_t capacity_;
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::deque<State> queue_;
+  // Sequence numbers of the pushed and written states.
+  uint64_t pushed_ = 0;
+  uint64_t written_ = 0;
+  std::deque<std::pair<uint64_t, std::promise<void>>> flushes_;
+  std::exception_ptr error_;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+}  // namespace aether
+
+#endif  // AETHER_ASYNC_STORE_H_
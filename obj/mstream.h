@@ -13,12 +13,23 @@
 #ifndef AETHER_MSTREAM_H_
 #define AETHER_MSTREAM_H_
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
 #include <cstring>
 #include <deque>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <optional>
+#include <set>
 #include <string>
+#include <string_view>
+#include <tuple>
 #include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <variant>
 #include <vector>
 
 // If the platform doesn't support uint8_t let's define something close.
@@ -38,18 +49,20 @@ typedef unsigned char uint8_t;
 #define AETHER_THROW(F, ...) throw std::runtime_error(F);
 #endif
 
+// aether::obuffer can be used instead to avoid reallocations of large
+// streams.
 #ifndef AETHER_OSTREAM_CONTAINER
 #define AETHER_OSTREAM_CONTAINER std::vector<uint8_t>
+#endif
+#ifndef AETHER_CONTAINER_WRITE
 #define AETHER_CONTAINER_WRITE(stream, data, size)                    \
   stream.insert(stream.end(), reinterpret_cast<const uint8_t*>(data), \
                 reinterpret_cast<const uint8_t*>(data) + size);
 #endif
 
 #ifndef AETHER_ISTREAM_CONTAINER
-#define AETHER_ISTREAM_CONTAINER std::vector<uint8_t>
-#define AETHER_CONTAINER_READ(stream, data, size) \
-  std::memcpy(data, stream.data(), size);         \
-  stream.erase(stream.begin(), stream_.begin() + size);
+#define AETHER_ISTREAM_CONTAINER aether::ibuffer
+#define AETHER_CONTAINER_READ(stream, data, size) stream.read(data, size);
 #endif
 
 namespace aether {
@@ -153,16 +166,321 @@ constexpr uint8_t kNonTrivialVectorTypeIndex = 255;
 constexpr uint8_t kTrivialVectorTypeIndex = 254;
 constexpr uint8_t kMapTypeIndex = 253;
 constexpr uint8_t kDequeTypeIndex = 252;
+constexpr uint8_t kPackTypeIndex = 251;
+constexpr uint8_t kUnorderedMapTypeIndex = 250;
+constexpr uint8_t kSetTypeIndex = 249;
+constexpr uint8_t kArrayTypeIndex = 248;
+constexpr uint8_t kOptionalTypeIndex = 247;
+constexpr uint8_t kTupleTypeIndex = 246;
+constexpr uint8_t kVariantTypeIndex = 245;
+// References are not written with a type index of their own, the index is
+// folded into the schema fingerprints only.
+constexpr uint8_t kRefTypeIndex = 244;
 
 template <typename T>
 constexpr uint8_t TypeToIndex() {
   return TypeToIndexImpl<typename std::remove_const<T>::type>::value;
 }
 
+// Input container with a read cursor. Reading advances the cursor and never
+// moves the remaining bytes so a blob is read in linear time. The bytes are
+// either owned or borrowed with 'borrow': borrowed memory is never copied and
+// must outlive the reading. The owner of the borrowed memory, if given, is
+// shared by the copies of the buffer.
+class ibuffer {
+ public:
+  using value_type = uint8_t;
+  using const_iterator = const uint8_t*;
+  using iterator = const_iterator;
+
+  ibuffer() = default;
+  ibuffer(std::vector<uint8_t>&& v) { *this = std::move(v); }
+  ibuffer(const ibuffer& b) { *this = b; }
+  ibuffer(ibuffer&& b) noexcept { *this = std::move(b); }
+  ibuffer& operator=(std::vector<uint8_t>&& v) {
+    owned_ = std::move(v);
+    owner_.reset();
+    cur_ = owned_.data();
+    end_ = cur_ + owned_.size();
+    return *this;
+  }
+  ibuffer& operator=(const ibuffer& b) {
+    if (this == &b) return *this;
+    if (b.is_owned()) return *this = std::vector<uint8_t>(b.begin(), b.end());
+    owned_.clear();
+    owner_ = b.owner_;
+    cur_ = b.cur_;
+    end_ = b.end_;
+    return *this;
+  }
+  ibuffer& operator=(ibuffer&& b) noexcept {
+    if (this == &b) return *this;
+    // Moving the vector keeps the data in place so the cursor remains valid.
+    owned_ = std::move(b.owned_);
+    owner_ = std::move(b.owner_);
+    cur_ = b.cur_;
+    end_ = b.end_;
+    b.clear();
+    return *this;
+  }
+
+  // Reads from external memory without copying. The owner keeps the memory
+  // alive while the buffer or the views into it are used.
+  void borrow(const void* data, size_t size,
+              std::shared_ptr<const void> owner = nullptr) {
+    owned_.clear();
+    owner_ = std::move(owner);
+    cur_ = static_cast<const uint8_t*>(data);
+    end_ = cur_ + size;
+  }
+  bool is_owned() const { return !owned_.empty(); }
+  const std::shared_ptr<const void>& owner() const { return owner_; }
+  // Moves the owned bytes into the shared owner without copying so parts of
+  // them can be borrowed.
+  const std::shared_ptr<const void>& share() {
+    if (is_owned())
+      owner_ = std::make_shared<std::vector<uint8_t>>(std::move(owned_));
+    return owner_;
+  }
+
+  void read(void* data, size_t size) {
+    std::memcpy(data, cur_, size);
+    cur_ += size;
+  }
+  void skip(size_t size) { cur_ += size; }
+
+  // Unread bytes.
+  const uint8_t* data() const { return cur_; }
+  size_t size() const { return static_cast<size_t>(end_ - cur_); }
+  bool empty() const { return cur_ == end_; }
+  const_iterator begin() const { return cur_; }
+  const_iterator end() const { return end_; }
+  void clear() {
+    owned_.clear();
+    owner_.reset();
+    cur_ = end_ = nullptr;
+  }
+
+  // Filling the container copies the unread bytes into the owned storage.
+  void resize(size_t size) {
+    std::vector<uint8_t> v(cur_, cur_ + std::min(size, this->size()));
+    v.resize(size);
+    *this = std::move(v);
+  }
+  template <typename It>
+  void insert(const_iterator pos, It first, It last) {
+    std::vector<uint8_t> v(cur_, end_);
+    v.insert(v.begin() + (pos - cur_), first, last);
+    *this = std::move(v);
+  }
+
+ private:
+  std::vector<uint8_t> owned_;
+  std::shared_ptr<const void> owner_;
+  const uint8_t* cur_ = nullptr;
+  const uint8_t* end_ = nullptr;
+};
+
+// Other input containers, e.g. std::vector<uint8_t> selected with
+// AETHER_ISTREAM_CONTAINER and AETHER_CONTAINER_READ, own their bytes: the
+// borrowed bytes are copied into them and the views read from them are copies.
+template <typename C>
+void Borrow(C& c, const uint8_t* data, size_t size,
+            std::shared_ptr<const void> owner = nullptr) {
+  if constexpr (std::is_same<C, ibuffer>::value) {
+    c.borrow(data, size, std::move(owner));
+  } else {
+    c = C(data, data + size);
+  }
+}
+
+// Takes the part of the record as the state of a class.
+template <typename C>
+void Slice(C& c, C& record, size_t offset, size_t size) {
+  if constexpr (std::is_same<C, ibuffer>::value) {
+    c.borrow(record.data() + offset, size, record.share());
+  } else {
+    auto first = record.begin() + offset;
+    c = C(first, first + size);
+  }
+}
+
+// True if the container keeps the bytes viewed in place alive.
+template <typename C>
+bool KeepsViews(const C& c) {
+  if constexpr (std::is_same<C, ibuffer>::value) {
+    return c.is_owned() || c.owner();
+  } else {
+    return false;
+  }
+}
+
+// Skips and returns the next bytes if they can be viewed in place, i.e. they
+// are aligned and kept alive by the container. Returns nullptr otherwise.
+template <typename C>
+const uint8_t* ViewInPlace(C& c, size_t size, size_t align) {
+  if constexpr (std::is_same<C, ibuffer>::value) {
+    const uint8_t* p = c.data();
+    if (reinterpret_cast<uintptr_t>(p) % align != 0 || !KeepsViews(c))
+      return nullptr;
+    c.skip(size);
+    return p;
+  } else {
+    return nullptr;
+  }
+}
+
+// Contiguous part of an output container. The list of segments is handed to
+// the storage as is, e.g. as iovec for writev.
+struct segment {
+  const void* data;
+  size_t size;
+};
+
+// Output container made of a chain of fixed-size chunks. Appending never moves
+// the written bytes so large streams are neither reallocated nor concatenated.
+// Chunks of destroyed buffers are kept in a thread-local pool for reuse.
+class obuffer {
+ public:
+  static constexpr size_t kChunkSize = 64 * 1024;
+  // Chunks kept in the pool per thread.
+  static constexpr size_t kPoolSize = 64;
+  using value_type = uint8_t;
+
+  class const_iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = uint8_t;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const uint8_t*;
+    using reference = const uint8_t&;
+    const_iterator(const obuffer* b, size_t i) : b_(b), i_(i) {}
+    reference operator*() const { return (*b_)[i_]; }
+    const_iterator& operator++() {
+      i_++;
+      return *this;
+    }
+    const_iterator operator++(int) { return {b_, i_++}; }
+    bool operator==(const const_iterator& i) const { return i_ == i.i_; }
+    bool operator!=(const const_iterator& i) const { return i_ != i.i_; }
+
+   private:
+    const obuffer* b_;
+    size_t i_;
+  };
+  using iterator = const_iterator;
+
+  obuffer() = default;
+  obuffer(const obuffer& b) { *this = b; }
+  obuffer(obuffer&& b) noexcept { *this = std::move(b); }
+  ~obuffer() { clear(); }
+  obuffer& operator=(const obuffer& b) {
+    if (this == &b) return *this;
+    clear();
+    for (const auto& s : b.segments()) write(s.data, s.size);
+    return *this;
+  }
+  obuffer& operator=(obuffer&& b) noexcept {
+    if (this == &b) return *this;
+    clear();
+    chunks_ = std::move(b.chunks_);
+    size_ = b.size_;
+    b.chunks_.clear();
+    b.size_ = 0;
+    return *this;
+  }
+
+  void write(const void* data, size_t size) {
+    auto p = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+      if (size_ == chunks_.size() * kChunkSize) chunks_.push_back(Acquire());
+      size_t offset = size_ - (chunks_.size() - 1) * kChunkSize;
+      size_t n = std::min(size, kChunkSize - offset);
+      std::memcpy(chunks_.back().get() + offset, p, n);
+      p += n;
+      size -= n;
+      size_ += n;
+    }
+  }
+  // Only appending is supported.
+  template <typename It>
+  void insert(const_iterator, It first, It last) {
+    write(&*first, static_cast<size_t>(last - first));
+  }
+
+  std::vector<segment> segments() const {
+    std::vector<segment> s;
+    s.reserve(chunks_.size());
+    for (size_t i = 0; i < chunks_.size(); i++) {
+      s.push_back(
+          {chunks_[i].get(), std::min(kChunkSize, size_ - i * kChunkSize)});
+    }
+    return s;
+  }
+
+  uint8_t& operator[](size_t i) {
+    return chunks_[i / kChunkSize][i % kChunkSize];
+  }
+  const uint8_t& operator[](size_t i) const {
+    return chunks_[i / kChunkSize][i % kChunkSize];
+  }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const_iterator begin() const { return {this, 0}; }
+  const_iterator end() const { return {this, size_}; }
+  void clear() {
+    auto& pool = Pool();
+    for (auto& c : chunks_) {
+      if (pool.size() < kPoolSize) pool.push_back(std::move(c));
+    }
+    chunks_.clear();
+    size_ = 0;
+  }
+
+ private:
+  using Chunk = std::unique_ptr<uint8_t[]>;
+  static std::vector<Chunk>& Pool() {
+    thread_local std::vector<Chunk> pool;
+    return pool;
+  }
+  static Chunk Acquire() {
+    auto& pool = Pool();
+    if (pool.empty()) return Chunk(new uint8_t[kChunkSize]);
+    Chunk c = std::move(pool.back());
+    pool.pop_back();
+    return c;
+  }
+
+  std::vector<Chunk> chunks_;
+  size_t size_ = 0;
+};
+
+inline std::vector<segment> Segments(const std::vector<uint8_t>& v) {
+  if (v.empty()) return {};
+  return {{v.data(), v.size()}};
+}
+inline std::vector<segment> Segments(const obuffer& b) { return b.segments(); }
+
 // Base classes to simplify std::conditional checks in serialization functions.
 class ostream {};
 class istream {};
 
+// Encoding of the values is selected at runtime. Compact streams have no type
+// indices, integers are written as LEB128 (signed integers are zigzag-encoded
+// first) and consecutive bools are packed into bits of a byte.
+enum class Encoding : uint8_t { kFixed, kCompact };
+
+// Schema fingerprints are FNV-1a hashes of the type indices of the fields.
+constexpr uint32_t kSchemaSeed = 2166136261u;
+constexpr uint32_t FoldSchema(uint32_t schema, uint8_t type_index) {
+  return (schema ^ type_index) * 16777619u;
+}
+constexpr uint32_t CombineSchema(uint32_t schema, uint32_t other) {
+  for (int i = 0; i < 4; i++)
+    schema = FoldSchema(schema, static_cast<uint8_t>(other >> (i * 8)));
+  return schema;
+}
+
 template <bool Typed, typename Custom>
 class ostream_impl : public ostream {
  public:
@@ -177,14 +495,36 @@ class ostream_impl : public ostream {
   };
   struct Writer {
     static void write(ostream_impl<Typed, Custom>* stream, uint8_t type_index) {
+      if (stream->encoding_ == Encoding::kCompact) return;
       stream->write(&type_index, sizeof(type_index));
     }
   };
   void write_type(uint8_t type_index) {
     std::conditional<Typed, Writer, VoidWriter>::type::write(this, type_index);
   }
+  void write_schema(uint32_t schema) { write(&schema, sizeof(schema)); }
+  bool has_type_indices() const {
+    return Typed && encoding_ == Encoding::kFixed;
+  }
+
+  // Appends the bit to the last byte of bits or to a new byte.
+  void write_bit(bool b) {
+    if (bit_ == 8) {
+      uint8_t bits = 0;
+      write(&bits, sizeof(bits));
+      bits_pos_ = stream_.size() - 1;
+      bit_ = 0;
+    }
+    if (b) stream_[bits_pos_] |= static_cast<uint8_t>(1u << bit_);
+    bit_++;
+  }
 
+  Encoding encoding_ = Encoding::kFixed;
   AETHER_OSTREAM_CONTAINER stream_;
+
+ private:
+  size_t bits_pos_ = 0;
+  uint8_t bit_ = 8;
 };
 template <typename Custom>
 using omstream = ostream_impl<false, Custom>;
@@ -221,17 +561,117 @@ class istream_impl : public istream {
     }
   };
   void readTypeAndCheck(uint8_t type_index) {
+    if (encoding_ == Encoding::kCompact) return;
     std::conditional<Typed, Reader, VoidReader>::type::read_type_and_check(
         this, type_index);
   }
 
+  bool read_bit() {
+    if (bit_ == 8) {
+      read(&bits_, sizeof(bits_));
+      bit_ = 0;
+    }
+    return (bits_ >> bit_++) & 1;
+  }
+
+  // Returns the next bytes in place and skips them. Bytes not aligned for the
+  // type and bytes borrowed without the owner are copied. The viewed stream
+  // and the copies are pinned by the domain when the state is loaded. Views
+  // are in place with ibuffer as the container only.
+  const void* read_view(size_t size, size_t align = 1) {
+    if (size > stream_.size()) {
+      AETHER_THROW(
+          AETHER_TEXT(
+              "imstream: viewing {0} bytes from stream containing {1} bytes"),
+          size, stream_.size());
+    }
+    views_ = true;
+    if (const uint8_t* p = ViewInPlace(stream_, size, align)) return p;
+    copies_.emplace_back(size);
+    read(copies_.back().data(), size);
+    return copies_.back().data();
+  }
+
+  void check_schema(uint32_t expected) {
+    uint32_t schema;
+    read(&schema, sizeof(schema));
+    if (schema != expected) {
+      AETHER_THROW(AETHER_TEXT("imstream: schema {0} is read as {1}"), schema,
+                   expected);
+    }
+  }
+
+  bool has_type_indices() const {
+    return Typed && encoding_ == Encoding::kFixed;
+  }
+
+  Encoding encoding_ = Encoding::kFixed;
   AETHER_ISTREAM_CONTAINER stream_;
+  // Set if a view into the stream is read.
+  bool views_ = false;
+  std::vector<std::vector<uint8_t>> copies_;
+
+ private:
+  uint8_t bits_ = 0;
+  uint8_t bit_ = 8;
 };
 template <typename Custom>
 using imstream = istream_impl<false, Custom>;
 template <typename Custom>
 using timstream = istream_impl<true, Custom>;
 
+// Integers of the compact encoding.
+template <typename T, typename S>
+S& WriteCompact(S& s, T t) {
+  if constexpr (std::is_same<T, bool>::value) {
+    s.write_bit(t);
+  } else if constexpr (sizeof(T) == 1) {
+    s.write(&t, sizeof(t));
+  } else {
+    using U = typename std::make_unsigned<T>::type;
+    U v = static_cast<U>(t);
+    if constexpr (std::is_signed<T>::value) {
+      v = static_cast<U>(static_cast<U>(v << 1) ^
+                         static_cast<U>(t >> (sizeof(T) * 8 - 1)));
+    }
+    uint8_t buffer[(sizeof(T) * 8 + 6) / 7];
+    size_t size = 0;
+    while (v >= 0x80) {
+      buffer[size++] = static_cast<uint8_t>(v) | 0x80;
+      v = static_cast<U>(v >> 7);
+    }
+    buffer[size++] = static_cast<uint8_t>(v);
+    s.write(buffer, size);
+  }
+  return s;
+}
+template <typename T, typename S>
+S& ReadCompact(S& s, T& t) {
+  if constexpr (std::is_same<T, bool>::value) {
+    t = s.read_bit();
+  } else if constexpr (sizeof(T) == 1) {
+    s.read(&t, sizeof(t));
+  } else {
+    using U = typename std::make_unsigned<T>::type;
+    U v = 0;
+    for (unsigned shift = 0;; shift += 7) {
+      if (shift >= sizeof(T) * 8) {
+        AETHER_THROW(AETHER_TEXT("imstream: varint overflows {0} bytes"),
+                     sizeof(T));
+      }
+      uint8_t b;
+      s.read(&b, sizeof(b));
+      v = static_cast<U>(v | (static_cast<U>(b & 0x7f) << shift));
+      if (!(b & 0x80)) break;
+    }
+    if constexpr (std::is_signed<T>::value) {
+      v = static_cast<U>((v >> 1) ^ (~(v & 1) + 1));
+    }
+    t = static_cast<T>(v);
+  }
+  return s;
+}
+
 // All other operators uses this two operators as end-points of read/write
 // operations
 template <typename T, typename S>
@@ -243,6 +683,9 @@ S& WriteTrivial(S& s, const T& t) {
                 "Error: omstream can't automatically serialize a pointer. \
                  Provide serialization operator.");
   s.write_type(TypeToIndex<T>());
+  if constexpr (std::is_integral<T>::value) {
+    if (s.encoding_ == Encoding::kCompact) return WriteCompact(s, t);
+  }
   s.write(&t, sizeof(T));
   return s;
 }
@@ -264,6 +707,9 @@ S& ReadTrivial(S& s, T& t) {
                 "Error: imstream can't automatically deserialize pointer. \
                  Provide deserialization operator.");
   s.readTypeAndCheck(TypeToIndex<T>());
+  if constexpr (std::is_integral<T>::value) {
+    if (s.encoding_ == Encoding::kCompact) return ReadCompact(s, t);
+  }
   s.read(&t, sizeof(T));
   return s;
 }
@@ -320,6 +766,83 @@ istream_impl<Typed, Custom>& operator>>(istream_impl<Typed, Custom>& s,
   return ReadString(s, t);
 }
 
+// Views are written as the viewed types so std::string and std::vector fields
+// can be loaded as views and vice versa.
+template <bool Typed, typename Custom>
+ostream_impl<Typed, Custom>& operator<<(ostream_impl<Typed, Custom>& s,
+                                        const std::string_view& t) {
+  s.write_type(TypeToIndex<std::string>());
+  s << static_cast<uint32_t>(t.size());
+  s.write(t.data(), t.size());
+  return s;
+}
+template <bool Typed, typename Custom>
+istream_impl<Typed, Custom>& operator>>(istream_impl<Typed, Custom>& s,
+                                        std::string_view& t) {
+  s.readTypeAndCheck(TypeToIndex<std::string>());
+  uint32_t size;
+  s >> size;
+  t = std::string_view(static_cast<const char*>(s.read_view(size)), size);
+  return s;
+}
+
+// Read-only view of trivially copyable elements that doesn't own them.
+template <typename T>
+class span {
+ public:
+  static_assert(std::is_trivially_copyable<T>::value,
+                "Error: only trivially copyable elements can be viewed.");
+  span() = default;
+  span(const T* data, size_t size) : data_(data), size_(size) {}
+  span(const std::vector<T>& v) : data_(v.data()), size_(v.size()) {}
+
+  const T* data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const T* begin() const { return data_; }
+  const T* end() const { return data_ + size_; }
+  const T& operator[](size_t i) const { return data_[i]; }
+
+ private:
+  const T* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Views are trivially copyable but are written as the viewed elements.
+template <typename T>
+struct IsView : std::false_type {};
+template <>
+struct IsView<std::string_view> : std::true_type {};
+template <typename T>
+struct IsView<span<T>> : std::true_type {};
+
+template <bool Typed, typename T, typename Custom>
+ostream_impl<Typed, Custom>& operator<<(ostream_impl<Typed, Custom>& s,
+                                        const span<T>& t) {
+  s.write_type(kTrivialVectorTypeIndex);
+  s.write_type(TypeToIndex<T>());
+  s << static_cast<uint32_t>(t.size());
+  if (!t.empty()) s.write(t.data(), t.size() * sizeof(T));
+  return s;
+}
+template <bool Typed, typename T, typename Custom>
+istream_impl<Typed, Custom>& operator>>(istream_impl<Typed, Custom>& s,
+                                        span<T>& t) {
+  s.readTypeAndCheck(kTrivialVectorTypeIndex);
+  s.readTypeAndCheck(TypeToIndex<T>());
+  uint32_t size;
+  s >> size;
+  if (size > s.stream_.size() / sizeof(T)) {
+    AETHER_THROW(
+        AETHER_TEXT("imstream: viewing {0} elements from stream containing "
+                    "{1} bytes"),
+        size, s.stream_.size());
+  }
+  t = span<T>(static_cast<const T*>(s.read_view(size * sizeof(T), alignof(T))),
+              size);
+  return s;
+}
+
 template <typename T, typename S>
 struct VectorWriterContinuous {
   static void save(S& s, const std::vector<T>& t) {
@@ -343,7 +866,7 @@ struct VectorWriterPerElement {
 };
 template <typename T, typename S>
 S& WriteVector(S& s, const std::vector<T>& t) {
-  std::conditional<std::is_trivially_copyable<T>::value,
+  std::conditional<std::is_trivially_copyable<T>::value && !IsView<T>::value,
                    VectorWriterContinuous<T, S>,
                    VectorWriterPerElement<T, S>>::type::save(s, t);
   return s;
@@ -373,16 +896,22 @@ struct VectorReaderPerElement {
     s.readTypeAndCheck(kNonTrivialVectorTypeIndex);
     uint32_t size;
     s >> size;
-    if (size > 0) {
+    if (size == 0) return;
+    if (!t.empty()) {
       t.resize(size);
-
       for (T& v : t) s >> v;
+      return;
     }
+    // Elements of an empty vector are constructed one by one in place while
+    // reading. The reservation is bounded by the stream size so a corrupted
+    // size fails before a huge allocation.
+    t.reserve(std::min<size_t>(size, s.stream_.size()));
+    for (uint32_t i = 0; i < size; i++) s >> t.emplace_back();
   }
 };
 template <typename T, typename S>
 S& ReadVector(S& s, std::vector<T>& t) {
-  std::conditional<std::is_trivially_copyable<T>::value,
+  std::conditional<std::is_trivially_copyable<T>::value && !IsView<T>::value,
                    VectorReaderContinuous<T, S>,
                    VectorReaderPerElement<T, S>>::type::load(s, t);
   return s;
@@ -413,12 +942,13 @@ istream_impl<Typed, Custom>& operator>>(istream_impl<Typed, Custom>& s,
   s.readTypeAndCheck(TypeToIndex<T2>());
   uint32_t size;
   s >> size;
+  // Keys are stored in order so each element is inserted at the end.
   for (uint32_t i = 0; i < size; i++) {
     T1 k;
     s >> k;
     T2 v;
     s >> v;
-    t.emplace(k, std::move(v));
+    t.emplace_hint(t.end(), std::move(k), std::move(v));
   }
   return s;
 }
@@ -441,13 +971,389 @@ istream_impl<Typed, Custom>& operator>>(istream_impl<Typed, Custom>& s,
   s.readTypeAndCheck(TypeToIndex<T>());
   uint32_t size;
   s >> size;
+  size_t first = t.size();
+  t.resize(first + size);
+  for (auto it = t.begin() + first; it != t.end(); ++it) s >> *it;
+  return s;
+}
+
+template <bool Typed, typename K, typename V, typename Custom>
+ostream_impl<Typed, Custom>& operator<<(ostream_impl<Typed, Custom>& s,
+                                        const std::unordered_map<K, V>& t) {
+  s.write_type(kUnorderedMapTypeIndex);
+  s.write_type(TypeToIndex<K>());
+  s.write_type(TypeToIndex<V>());
+  s << uint32_t(t.size());
+  for (const auto& i : t) s << i.first << i.second;
+  return s;
+}
+template <bool Typed, typename K, typename V, typename Custom>
+istream_impl<Typed, Custom>& operator>>(istream_impl<Typed, Custom>& s,
+                                        std::unordered_map<K, V>& t) {
+  s.readTypeAndCheck(kUnorderedMapTypeIndex);
+  s.readTypeAndCheck(TypeToIndex<K>());
+  s.readTypeAndCheck(TypeToIndex<V>());
+  uint32_t size;
+  s >> size;
+  t.reserve(t.size() + size);
   for (uint32_t i = 0; i < size; i++) {
-    T v;
+    K k;
+    s >> k;
+    V v;
     s >> v;
-    t.push_back(std::move(v));
+    t.emplace(std::move(k), std::move(v));
+  }
+  return s;
+}
+
+// Trivially copyable elements are read into the block that is checked against
+// the stream size before allocating.
+template <typename T, typename S>
+std::vector<T> ReadBlock(S& s, uint32_t size) {
+  if (size > s.stream_.size() / sizeof(T)) {
+    AETHER_THROW(
+        AETHER_TEXT("imstream: reading {0} elements from stream containing "
+                    "{1} bytes"),
+        size, s.stream_.size());
+  }
+  std::vector<T> block(size);
+  if (size > 0) s.read(block.data(), size * sizeof(T));
+  return block;
+}
+
+template <typename T>
+constexpr bool IsBlock() {
+  return std::is_trivially_copyable<T>::value && !std::is_pointer<T>::value &&
+         !IsView<T>::value;
+}
+
+template <bool Typed, typename T, typename Custom>
+ostream_impl<Typed, Custom>& operator<<(ostream_impl<Typed, Custom>& s,
+                                        const std::set<T>& t) {
+  s.write_type(kSetTypeIndex);
+  s.write_type(TypeToIndex<T>());
+  s << uint32_t(t.size());
+  if constexpr (IsBlock<T>()) {
+    std::vector<T> block(t.begin(), t.end());
+    if (!block.empty()) s.write(block.data(), block.size() * sizeof(T));
+  } else {
+    for (const auto& i : t) s << i;
   }
   return s;
 }
+template <bool Typed, typename T, typename Custom>
+istream_impl<Typed, Custom>& operator>>(istream_impl<Typed, Custom>& s,
+                                        std::set<T>& t) {
+  s.readTypeAndCheck(kSetTypeIndex);
+  s.readTypeAndCheck(TypeToIndex<T>());
+  uint32_t size;
+  s >> size;
+  // Elements are stored in order so each element is inserted at the end.
+  if constexpr (IsBlock<T>()) {
+    for (const auto& v : ReadBlock<T>(s, size)) t.emplace_hint(t.end(), v);
+  } else {
+    for (uint32_t i = 0; i < size; i++) {
+      T v;
+      s >> v;
+      t.emplace_hint(t.end(), std::move(v));
+    }
+  }
+  return s;
+}
+
+template <bool Typed, typename T, size_t N, typename Custom>
+ostream_impl<Typed, Custom>& operator<<(ostream_impl<Typed, Custom>& s,
+                                        const std::array<T, N>& t) {
+  s.write_type(kArrayTypeIndex);
+  s.write_type(TypeToIndex<T>());
+  s << uint32_t(N);
+  if constexpr (IsBlock<T>()) {
+    if (N > 0) s.write(t.data(), N * sizeof(T));
+  } else {
+    for (const auto& i : t) s << i;
+  }
+  return s;
+}
+template <bool Typed, typename T, size_t N, typename Custom>
+istream_impl<Typed, Custom>& operator>>(istream_impl<Typed, Custom>& s,
+                                        std::array<T, N>& t) {
+  s.readTypeAndCheck(kArrayTypeIndex);
+  s.readTypeAndCheck(TypeToIndex<T>());
+  uint32_t size;
+  s >> size;
+  if (size != N) {
+    AETHER_THROW(AETHER_TEXT("imstream: reading array of {0} as {1}"), size,
+                 N);
+  }
+  if constexpr (IsBlock<T>()) {
+    if (N > 0) s.read(t.data(), N * sizeof(T));
+  } else {
+    for (auto& i : t) s >> i;
+  }
+  return s;
+}
+
+template <bool Typed, typename T, typename Custom>
+ostream_impl<Typed, Custom>& operator<<(ostream_impl<Typed, Custom>& s,
+                                        const std::optional<T>& t) {
+  s.write_type(kOptionalTypeIndex);
+  s << t.has_value();
+  if (t) s << *t;
+  return s;
+}
+template <bool Typed, typename T, typename Custom>
+istream_impl<Typed, Custom>& operator>>(istream_impl<Typed, Custom>& s,
+                                        std::optional<T>& t) {
+  s.readTypeAndCheck(kOptionalTypeIndex);
+  bool has_value;
+  s >> has_value;
+  if (has_value) {
+    s >> t.emplace();
+  } else {
+    t.reset();
+  }
+  return s;
+}
+
+template <bool Typed, typename T1, typename T2, typename Custom>
+ostream_impl<Typed, Custom>& operator<<(ostream_impl<Typed, Custom>& s,
+                                        const std::pair<T1, T2>& t) {
+  s.write_type(kTupleTypeIndex);
+  return s << t.first << t.second;
+}
+template <bool Typed, typename T1, typename T2, typename Custom>
+istream_impl<Typed, Custom>& operator>>(istream_impl<Typed, Custom>& s,
+                                        std::pair<T1, T2>& t) {
+  s.readTypeAndCheck(kTupleTypeIndex);
+  return s >> t.first >> t.second;
+}
+
+template <bool Typed, typename... T, typename Custom>
+ostream_impl<Typed, Custom>& operator<<(ostream_impl<Typed, Custom>& s,
+                                        const std::tuple<T...>& t) {
+  s.write_type(kTupleTypeIndex);
+  std::apply([&s](const auto&... e) { ((s << e), ...); }, t);
+  return s;
+}
+template <bool Typed, typename... T, typename Custom>
+istream_impl<Typed, Custom>& operator>>(istream_impl<Typed, Custom>& s,
+                                        std::tuple<T...>& t) {
+  s.readTypeAndCheck(kTupleTypeIndex);
+  std::apply([&s](auto&... e) { ((s >> e), ...); }, t);
+  return s;
+}
+
+// The index of the alternative is followed by its value.
+template <bool Typed, typename... T, typename Custom>
+ostream_impl<Typed, Custom>& operator<<(ostream_impl<Typed, Custom>& s,
+                                        const std::variant<T...>& t) {
+  s.write_type(kVariantTypeIndex);
+  s << static_cast<uint32_t>(t.index());
+  std::visit([&s](const auto& v) { s << v; }, t);
+  return s;
+}
+template <typename S, typename V, size_t... I>
+void ReadVariant(S& s, V& t, uint32_t index, std::index_sequence<I...>) {
+  ((index == I ? (void)(s >> t.template emplace<I>()) : void()), ...);
+}
+template <bool Typed, typename... T, typename Custom>
+istream_impl<Typed, Custom>& operator>>(istream_impl<Typed, Custom>& s,
+                                        std::variant<T...>& t) {
+  s.readTypeAndCheck(kVariantTypeIndex);
+  uint32_t index;
+  s >> index;
+  if (index >= sizeof...(T)) {
+    AETHER_THROW(AETHER_TEXT("imstream: variant index {0} of {1}"), index,
+                 sizeof...(T));
+  }
+  ReadVariant(s, t, index, std::index_sequence_for<T...>{});
+  return s;
+}
+
+// Trivially copyable fields are written as a single block of the size known
+// at compile time: s & aether::pack(a_, b_, c_). The block has one type index
+// and one bounds check and the fields are not compacted. Typed streams write
+// the compile-time fingerprint of the packed types after the type index.
+template <typename... T>
+struct packed {
+  static_assert(sizeof...(T) > 0, "Error: nothing to pack.");
+  static_assert((... && (std::is_trivially_copyable<T>::value &&
+                         !std::is_pointer<T>::value && !IsView<T>::value)),
+                "Error: only trivially copyable fields can be packed.");
+  static constexpr size_t kSize = (0 + ... + sizeof(T));
+  std::tuple<T&...> fields_;
+};
+template <typename... T>
+packed<T...> pack(T&... t) {
+  return {std::tie(t...)};
+}
+
+template <typename... T>
+constexpr uint32_t PackSchema() {
+  uint32_t schema = kSchemaSeed;
+  ((schema = FoldSchema(FoldSchema(schema, TypeToIndex<T>()),
+                        static_cast<uint8_t>(sizeof(T)))),
+   ...);
+  return schema;
+}
+
+template <bool Typed, typename Custom, typename... T>
+ostream_impl<Typed, Custom>& operator<<(ostream_impl<Typed, Custom>& s,
+                                        const packed<T...>& p) {
+  s.write_type(kPackTypeIndex);
+  if (s.has_type_indices()) {
+    constexpr uint32_t schema = PackSchema<T...>();
+    s.write(&schema, sizeof(schema));
+  }
+  auto fill = [&p](uint8_t* buffer) {
+    std::apply(
+        [buffer](const auto&... f) {
+          size_t offset = 0;
+          ((std::memcpy(buffer + offset, &f, sizeof(f)), offset += sizeof(f)),
+           ...);
+        },
+        p.fields_);
+  };
+  if constexpr (std::is_same<decltype(s.stream_),
+                             std::vector<uint8_t>>::value) {
+    // The fields are copied in place into the stream resized once.
+    size_t offset = s.stream_.size();
+    s.stream_.resize(offset + packed<T...>::kSize);
+    fill(s.stream_.data() + offset);
+  } else {
+    uint8_t buffer[packed<T...>::kSize];
+    fill(buffer);
+    s.write(buffer, sizeof(buffer));
+  }
+  return s;
+}
+template <bool Typed, typename Custom, typename... T>
+istream_impl<Typed, Custom>& operator>>(istream_impl<Typed, Custom>& s,
+                                        const packed<T...>& p) {
+  s.readTypeAndCheck(kPackTypeIndex);
+  if (s.has_type_indices()) {
+    uint32_t schema;
+    s.read(&schema, sizeof(schema));
+    if (schema != PackSchema<T...>()) {
+      AETHER_THROW(AETHER_TEXT("imstream: pack {0} is read as {1}"), schema,
+                   PackSchema<T...>());
+    }
+  }
+  auto load = [&p](const uint8_t* buffer) {
+    std::apply(
+        [buffer](auto&... f) {
+          size_t offset = 0;
+          ((std::memcpy(&f, buffer + offset, sizeof(f)), offset += sizeof(f)),
+           ...);
+        },
+        p.fields_);
+  };
+  if constexpr (std::is_same<decltype(s.stream_), ibuffer>::value) {
+    // The fields are copied straight from the stream.
+    if (packed<T...>::kSize > s.stream_.size()) {
+      AETHER_THROW(
+          AETHER_TEXT(
+              "imstream: reading {0} bytes from stream containing {1} bytes"),
+          packed<T...>::kSize, s.stream_.size());
+    }
+    load(s.stream_.data());
+    s.stream_.skip(packed<T...>::kSize);
+  } else {
+    uint8_t buffer[packed<T...>::kSize];
+    s.read(buffer, sizeof(buffer));
+    load(buffer);
+  }
+  return s;
+}
+// The packed fields are a temporary.
+template <bool Typed, typename Custom, typename... T>
+istream_impl<Typed, Custom>& operator&(istream_impl<Typed, Custom>& s,
+                                       const packed<T...>& p) {
+  return s >> p;
+}
+
+// Fingerprint of the type of a field. It depends on the types only, so all
+// states of a class have the same fingerprint. Elements of the containers are
+// folded once.
+template <typename T>
+struct TypeSchema {
+  static constexpr uint32_t value = FoldSchema(kSchemaSeed, TypeToIndex<T>());
+};
+template <typename... T>
+constexpr uint32_t NestedSchema(uint8_t type_index) {
+  uint32_t schema = FoldSchema(kSchemaSeed, type_index);
+  ((schema = CombineSchema(schema, TypeSchema<T>::value)), ...);
+  return schema;
+}
+template <>
+struct TypeSchema<std::string_view> : TypeSchema<std::string> {};
+template <typename T>
+struct TypeSchema<std::vector<T>> {
+  static constexpr uint32_t value = NestedSchema<T>(
+      std::is_trivially_copyable<T>::value && !IsView<T>::value
+          ? kTrivialVectorTypeIndex
+          : kNonTrivialVectorTypeIndex);
+};
+template <typename T>
+struct TypeSchema<span<T>> : TypeSchema<std::vector<T>> {};
+template <typename K, typename V>
+struct TypeSchema<std::map<K, V>> {
+  static constexpr uint32_t value = NestedSchema<K, V>(kMapTypeIndex);
+};
+template <typename T>
+struct TypeSchema<std::deque<T>> {
+  static constexpr uint32_t value = NestedSchema<T>(kDequeTypeIndex);
+};
+template <typename K, typename V>
+struct TypeSchema<std::unordered_map<K, V>> {
+  static constexpr uint32_t value = NestedSchema<K, V>(kUnorderedMapTypeIndex);
+};
+template <typename T>
+struct TypeSchema<std::set<T>> {
+  static constexpr uint32_t value = NestedSchema<T>(kSetTypeIndex);
+};
+template <typename T, size_t N>
+struct TypeSchema<std::array<T, N>> {
+  static constexpr uint32_t value =
+      CombineSchema(NestedSchema<T>(kArrayTypeIndex), static_cast<uint32_t>(N));
+};
+template <typename T>
+struct TypeSchema<std::optional<T>> {
+  static constexpr uint32_t value = NestedSchema<T>(kOptionalTypeIndex);
+};
+template <typename T1, typename T2>
+struct TypeSchema<std::pair<T1, T2>> {
+  static constexpr uint32_t value = NestedSchema<T1, T2>(kTupleTypeIndex);
+};
+template <typename... T>
+struct TypeSchema<std::tuple<T...>> {
+  static constexpr uint32_t value = NestedSchema<T...>(kTupleTypeIndex);
+};
+template <typename... T>
+struct TypeSchema<std::variant<T...>> {
+  static constexpr uint32_t value = NestedSchema<T...>(kVariantTypeIndex);
+};
+template <typename... T>
+struct TypeSchema<packed<T...>> {
+  static constexpr uint32_t value = CombineSchema(
+      FoldSchema(kSchemaSeed, kPackTypeIndex), PackSchema<T...>());
+};
+
+// Type-only stream: Serializator is instantiated with it to compute the
+// fingerprint of a class from the types of its fields without the values.
+class SchemaVisitor : public ostream {
+ public:
+  uint32_t schema_ = kSchemaSeed;
+};
+template <typename T>
+SchemaVisitor& operator<<(SchemaVisitor& v, const T&) {
+  v.schema_ = CombineSchema(v.schema_, TypeSchema<T>::value);
+  return v;
+}
+template <typename T>
+SchemaVisitor& operator&(SchemaVisitor& v, const T& t) {
+  return v << t;
+}
 
 // & bi-directional operators
 template <bool Typed, typename T, typename Custom>
@@ -14,17 +14,24 @@
 #define AETHER_OBJ_H_
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cstdint>
 #include <functional>
 #include <limits>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
 #include <random>
 #include <set>
 #include <stdexcept>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
+#include <variant>
 
 #include "../third_party/crc32/crc32.h"
 
@@ -34,39 +41,89 @@ class Obj;
 }  // namespace aether
 
 #include "mstream.h"
+// Typed streams check the type of each value. Untyped streams can be selected
+// instead: they are smaller and mismatched classes are detected by the schema
+// fingerprint of each class state if the domain stores them, but their states
+// are not compatible with the typed ones.
+#ifndef AETHER_OMSTREAM
 #define AETHER_OMSTREAM aether::tomstream<aether::Domain*>
 #define AETHER_IMSTREAM aether::timstream<aether::Domain*>
+#endif
+
+// 64-bit ids can be used for domains with a large number of objects to make
+// collisions of random ids negligible.
+#ifndef AETHER_OBJID_TYPE
+#define AETHER_OBJID_TYPE uint32_t
+#endif
 
 namespace aether {
 
 class ObjId {
  public:
-  using Type = uint32_t;
+  using Type = AETHER_OBJID_TYPE;
+  static_assert(std::is_unsigned<Type>::value && sizeof(Type) <= 8,
+                "ObjId type must be an unsigned integer up to 64 bits");
   ObjId() { Invalidate(); }
   ObjId(const Type& i) : id_(i) {}
+  // Each thread generates ids with its own splitmix64 sequence so no locking
+  // is required. Sequences of threads are separated by the seed.
   static ObjId GenerateUnique() {
-    static std::random_device dev;
-    static std::mt19937 rng(dev());
-    static std::uniform_int_distribution<std::mt19937::result_type> dist6(
-        1, std::numeric_limits<Type>::max());
-    return dist6(rng);
+    thread_local uint64_t state = Seed();
+    while (true) {
+      uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      Type id = static_cast<Type>(z ^ (z >> 31));
+      if (id != 0) return id;
+    }
   }
   void Invalidate() { id_ = 0; }
   bool IsValid() const { return id_ != 0; }
   bool operator<(const ObjId& i) const { return id_ < i.id_; }
   bool operator!=(const ObjId& i) const { return id_ != i.id_; }
   bool operator==(const ObjId& i) const { return id_ == i.id_; }
+  struct Hash {
+    size_t operator()(const ObjId& i) const { return std::hash<Type>()(i.id_); }
+  };
   friend AETHER_OMSTREAM& operator<<(AETHER_OMSTREAM& s, const ObjId& i) {
     return s << i.id_;
   }
   friend AETHER_IMSTREAM& operator>>(AETHER_IMSTREAM& s, ObjId& i) {
+    if constexpr (sizeof(Type) > sizeof(uint32_t)) {
+      // Typed states stored with 32-bit ids are loaded with the wider ids.
+      if (s.has_type_indices()) {
+        uint8_t index;
+        s.read(&index, sizeof(index));
+        if (index == TypeToIndex<uint32_t>()) {
+          uint32_t id;
+          s.read(&id, sizeof(id));
+          i.id_ = id;
+          return s;
+        }
+        if (index != TypeToIndex<Type>()) {
+          AETHER_THROW(AETHER_TEXT("timstream: error reading type {0} as {1}"),
+                       int{index}, int{TypeToIndex<Type>()});
+        }
+        s.read(&i.id_, sizeof(i.id_));
+        return s;
+      }
+    }
     return s >> i.id_;
   }
 
   std::string ToString() const { return std::to_string(id_); }
+  Type GetValue() const { return id_; }
 
  protected:
   Type id_;
+
+ private:
+  static uint64_t Seed() {
+    static std::atomic<uint64_t> counter{0};
+    std::random_device dev;
+    uint64_t seed = (uint64_t{dev()} << 32) ^ dev();
+    return seed ^ (counter.fetch_add(1) * 0xd1b54a32d192ed03ull);
+  }
 };
 
 class ObjFlags {
@@ -78,6 +135,9 @@ class ObjFlags {
     // used for loading.
     kUnloadedByDefault = 1,
     kUnloaded = 2,
+    // The reference is followed by the stored classes of the object so the
+    // loading doesn't enumerate them. Not kept by the object.
+    kClassesInline = 4,
   };
   operator uint8_t&() { return value_; }
   ObjFlags(uint8_t v) : value_(v) {}
@@ -98,6 +158,30 @@ using EnumerateFacility = std::function<std::vector<uint32_t>(
 using LoadFacility =
     std::function<void(const aether::Domain& domain, const ObjId& obj_id,
                        uint32_t class_id, AETHER_IMSTREAM& is)>;
+// Class state as the list of contiguous segments of the stream.
+using StoreBuffersFacility = std::function<void(
+    const aether::Domain& domain, const ObjId& obj_id, uint32_t class_id,
+    const std::vector<segment>& buffers)>;
+// Packed record of all classes of the object:
+//   uint32_t count, count * (uint32_t class_id, offset, length), payloads
+// Offsets are from the beginning of the record.
+using StoreObjectFacility =
+    std::function<void(const aether::Domain& domain, const ObjId& obj_id,
+                       const AETHER_OMSTREAM& os)>;
+using LoadObjectFacility =
+    std::function<void(const aether::Domain& domain, const ObjId& obj_id,
+                       AETHER_IMSTREAM& is)>;
+// Batch variants request many objects at once. The stored classes of the
+// requested objects are appended as (obj_id, class_id) in any order and the
+// class states are loaded into the streams in the order of the requested
+// states.
+using EnumerateBatchFacility = std::function<void(
+    const aether::Domain& domain, const std::vector<ObjId>& obj_ids,
+    std::vector<std::pair<ObjId, uint32_t>>& classes)>;
+using LoadBatchFacility = std::function<void(
+    const aether::Domain& domain,
+    const std::vector<std::pair<ObjId, uint32_t>>& states,
+    std::vector<AETHER_IMSTREAM>& streams)>;
 
 template <class T>
 class Ptr {
@@ -133,7 +217,7 @@ class Ptr {
     SetFlags(p.GetFlags());
   }
   // Example: A::ptr a2(std::move(a1));
-  Ptr(Ptr&& p) {
+  Ptr(Ptr&& p) noexcept {
     ptr_ = p.ptr_;
     SetId(p.GetId());
     SetFlags(p.GetFlags());
@@ -236,7 +320,8 @@ class Ptr {
 
   const ObjId& GetId() const { return ptr_ ? ptr_->id_ : id_; }
   void SetId(const ObjId& i) {
-    if (ptr_) ptr_->id_ = i;
+    // The object is indexed by id in the domain.
+    if (ptr_ && ptr_->id_ != i) ptr_->domain_->SetObjId(ptr_, i);
     id_ = i;
   }
   ObjFlags GetFlags() const { return ptr_ ? ptr_->flags_ : flags_; }
@@ -286,65 +371,241 @@ bool operator!=(const Ptr<T1>& p1, const Ptr<T2>& p2) {
   return !(p1 == p2);
 }
 
+// Reference-only stream: data fields are skipped and references to objects are
+// reported. Serializator is instantiated with the visitor for the
+// reachability analysis without serializing the data. Containers are walked
+// only if the elements can contain references.
+class RefVisitor : public ostream {
+ public:
+  using Callback = std::function<void(Obj*)>;
+  explicit RefVisitor(Callback on_ref) : on_ref_(std::move(on_ref)) {}
+  Callback on_ref_;
+};
+
+template <typename T>
+struct TypeSchema<Ptr<T>> {
+  static constexpr uint32_t value = FoldSchema(kSchemaSeed, kRefTypeIndex);
+};
+
+template <typename T>
+struct HasRefs : std::false_type {};
+template <typename T>
+struct HasRefs<Ptr<T>> : std::true_type {};
+template <typename T1, typename T2>
+struct HasRefs<std::pair<T1, T2>>
+    : std::integral_constant<bool, HasRefs<T1>::value || HasRefs<T2>::value> {
+};
+template <typename T, typename A>
+struct HasRefs<std::vector<T, A>> : HasRefs<T> {};
+template <typename T, typename A>
+struct HasRefs<std::deque<T, A>> : HasRefs<T> {};
+template <typename K, typename V, typename C, typename A>
+struct HasRefs<std::map<K, V, C, A>> : HasRefs<std::pair<K, V>> {};
+template <typename K, typename V, typename H, typename E, typename A>
+struct HasRefs<std::unordered_map<K, V, H, E, A>> : HasRefs<std::pair<K, V>> {
+};
+template <typename T, typename C, typename A>
+struct HasRefs<std::set<T, C, A>> : HasRefs<T> {};
+template <typename T, size_t N>
+struct HasRefs<std::array<T, N>> : HasRefs<T> {};
+template <typename T>
+struct HasRefs<std::optional<T>> : HasRefs<T> {};
+template <typename... T>
+struct HasRefs<std::tuple<T...>>
+    : std::integral_constant<bool, (... || HasRefs<T>::value)> {};
+template <typename... T>
+struct HasRefs<std::variant<T...>>
+    : std::integral_constant<bool, (... || HasRefs<T>::value)> {};
+
+template <typename T>
+void VisitRefs(RefVisitor& v, const Ptr<T>& p) {
+  if (p) v.on_ref_(p.ptr_);
+}
+template <typename T1, typename T2>
+void VisitRefs(RefVisitor& v, const std::pair<T1, T2>& p);
+template <typename T>
+void VisitRefs(RefVisitor& v, const std::optional<T>& o);
+template <typename... T>
+void VisitRefs(RefVisitor& v, const std::tuple<T...>& t);
+template <typename... T>
+void VisitRefs(RefVisitor& v, const std::variant<T...>& t);
+template <typename C>
+void VisitRefs(RefVisitor& v, const C& c);
+
+template <typename T>
+RefVisitor& operator<<(RefVisitor& v, const T& t) {
+  if constexpr (HasRefs<T>::value) VisitRefs(v, t);
+  return v;
+}
+template <typename T>
+RefVisitor& operator&(RefVisitor& v, const T& t) {
+  return v << t;
+}
+
+template <typename T1, typename T2>
+void VisitRefs(RefVisitor& v, const std::pair<T1, T2>& p) {
+  v << p.first << p.second;
+}
+template <typename T>
+void VisitRefs(RefVisitor& v, const std::optional<T>& o) {
+  if (o) v << *o;
+}
+template <typename... T>
+void VisitRefs(RefVisitor& v, const std::tuple<T...>& t) {
+  std::apply([&v](const auto&... e) { ((v << e), ...); }, t);
+}
+template <typename... T>
+void VisitRefs(RefVisitor& v, const std::variant<T...>& t) {
+  std::visit([&v](const auto& e) { v << e; }, t);
+}
+template <typename C>
+void VisitRefs(RefVisitor& v, const C& c) {
+  for (const auto& e : c) v << e;
+}
+
 enum class SerializationResult { kReferenceOnly, kWholeObject };
 template <class T, class T1>
 SerializationResult SerializeRef(T& s, const Ptr<T1>& o1);
 template <class T>
 Ptr<Obj> DeserializeRef(T& s);
+// Finds or loads the object with the stored classes or the classes provided.
+inline Ptr<Obj> LoadRef(Domain* domain, const ObjId& obj_id, ObjFlags obj_flags,
+                        std::vector<uint32_t>&& classes);
+
+// Bump allocator for the objects loaded at once. Memory is reclaimed at once
+// when all objects allocated in the arena are destroyed.
+class Arena {
+ public:
+  explicit Arena(size_t chunk_size = 64 * 1024) : chunk_size_(chunk_size) {}
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  void* Allocate(size_t size, size_t align) {
+    while (true) {
+      if (current_ < chunks_.size()) {
+        auto base = reinterpret_cast<uintptr_t>(chunks_[current_].first.get());
+        uintptr_t p = (base + offset_ + align - 1) & ~uintptr_t{align - 1};
+        if (p + size <= base + chunks_[current_].second) {
+          offset_ = p + size - base;
+          live_++;
+          return reinterpret_cast<void*>(p);
+        }
+        current_++;
+        offset_ = 0;
+        continue;
+      }
+      size_t chunk_size = std::max(chunk_size_, size + align);
+      chunks_.emplace_back(std::unique_ptr<uint8_t[]>(new uint8_t[chunk_size]),
+                           chunk_size);
+    }
+  }
+  // Releases an allocation. The arena is rewound and true is returned if no
+  // allocations left.
+  bool Free() {
+    if (--live_ > 0) return false;
+    current_ = 0;
+    offset_ = 0;
+    return true;
+  }
+
+  size_t live() const { return live_; }
+  size_t chunks() const { return chunks_.size(); }
+
+ private:
+  size_t chunk_size_;
+  std::vector<std::pair<std::unique_ptr<uint8_t[]>, size_t>> chunks_;
+  size_t current_ = 0;
+  size_t offset_ = 0;
+  size_t live_ = 0;
+};
 
 class Registry {
  public:
   struct Factory {
-    std::function<Obj*()> default;
+    std::function<Obj*()> create;
     std::function<Obj*(Obj*, Domain*)> construct;
+    // Construction in the provided memory.
+    std::function<Obj*(void*)> place;
+    std::function<Obj*(void*, Obj*, Domain*)> place_construct;
+    size_t size;
+    size_t align;
+  };
+  using Relations = std::unordered_map<uint32_t, std::vector<uint32_t>>;
+  using Factories = std::unordered_map<uint32_t, Factory>;
+  // Inheritance tables of a class precomputed for the snapshot.
+  struct ClassInfo {
+    // Euler tour interval and the depth in the inheritance tree: a class is
+    // derived from the class if the interval is nested.
+    int tin = 0;
+    int tout = 0;
+    int depth = 0;
+    // The most far derivative without ambiguous inheritance.
+    uint32_t final_id = 0;
+    // A derivative that is not inherited or the class itself.
+    uint32_t last_id = 0;
+    // Inheritance chain from the most base class to the class.
+    std::vector<uint32_t> chain;
+  };
+  // Registered classes. The same immutable instance is shared by all
+  // registries until a class is unregistered from the registry.
+  struct Classes {
+    Factories factories_;
+    Relations base_to_derived_;
+    std::unordered_map<uint32_t, ClassInfo> infos_;
+    inline void Build();
   };
+
   static void RegisterClass(uint32_t cls_id, uint32_t base_id,
                             Factory factory) {
-    Factories& factories = GetFactories();
-    if (factories.find(cls_id) != factories.end()) {
+    std::lock_guard<std::mutex> lock(GetMutex());
+    Classes& classes = GetClasses();
+    if (classes.factories_.find(cls_id) != classes.factories_.end()) {
       throw std::runtime_error(
           "Class name already registered or Crc32 collision detected. Please "
           "choose another "
           "name for the class.");
     }
-    factories[cls_id] = factory;
+    classes.factories_[cls_id] = factory;
     if (base_id != qcstudio::crc32::from_literal("Obj").value)
-      GetRelations()[base_id].push_back(cls_id);
+      classes.base_to_derived_[base_id].push_back(cls_id);
+    // The registered classes are changed so the snapshot is rebuilt on the next
+    // request.
+    GetSnapshot().reset();
   }
 
-  using Relations = std::unordered_map<uint32_t, std::vector<uint32_t>>;
-  Relations base_to_derived_;
-  using Factories = std::unordered_map<uint32_t, Factory>;
-  Factories factories_;
-  Registry() : factories_(GetFactories()), base_to_derived_(GetRelations()) {}
+  std::shared_ptr<const Classes> classes_;
+  const Factories& factories() const { return classes_->factories_; }
+  const Relations& base_to_derived() const {
+    return classes_->base_to_derived_;
+  }
+  Registry() : classes_(Snapshot()) {}
 
+  // Copy-on-write: other registries keep sharing the registered classes.
   void UnregisterClass(uint32_t cls_id) {
-    if (auto it = factories_.find(cls_id); it != factories_.end())
-      factories_.erase(it);
-    if (auto it = base_to_derived_.find(cls_id); it != base_to_derived_.end())
-      base_to_derived_.erase(it);
-    for (auto it = base_to_derived_.begin(); it != base_to_derived_.end();) {
+    auto classes = std::make_shared<Classes>(*classes_);
+    Factories& factories = classes->factories_;
+    Relations& base_to_derived = classes->base_to_derived_;
+    if (auto it = factories.find(cls_id); it != factories.end())
+      factories.erase(it);
+    if (auto it = base_to_derived.find(cls_id); it != base_to_derived.end())
+      base_to_derived.erase(it);
+    for (auto it = base_to_derived.begin(); it != base_to_derived.end();) {
       it->second.erase(
           std::remove(it->second.begin(), it->second.end(), cls_id),
           it->second.end());
-      it = it->second.empty() ? base_to_derived_.erase(it) : std::next(it);
+      it = it->second.empty() ? base_to_derived.erase(it) : std::next(it);
     }
+    classes->Build();
+    classes_ = std::move(classes);
   }
 
   bool IsExisting(uint32_t class_id) const {
-    return factories_.find(class_id) != factories_.end();
+    return factories().find(class_id) != factories().end();
   }
 
-  int GenerationDistanceInternal(uint32_t base_id, uint32_t derived_id) const {
-    auto d = base_to_derived_.find(base_id);
-    // The base class is final.
-    if (d == base_to_derived_.end()) return -1;
-    for (auto& c : d->second) {
-      if (derived_id == c) return 1;
-      int distance = GenerationDistanceInternal(c, derived_id);
-      if (distance >= 0) return distance + 1;
-    }
-    return -1;
+  const ClassInfo* Info(uint32_t class_id) const {
+    auto it = classes_->infos_.find(class_id);
+    return it != classes_->infos_.end() ? &it->second : nullptr;
   }
 
   // Calculates distance from base to derived in generations:
@@ -352,44 +613,209 @@ class Registry {
   //  class doesn't exist.
   int GenerationDistance(uint32_t base_id, uint32_t derived_id) const {
     if (!IsExisting(base_id) || !IsExisting(derived_id)) return -1;
-    if (base_id == derived_id) return 0;
-    return GenerationDistanceInternal(base_id, derived_id);
+    const ClassInfo* b = Info(base_id);
+    const ClassInfo* d = Info(derived_id);
+    if (b->tin > d->tin || d->tout > b->tout) return -1;
+    return d->depth - b->depth;
+  }
+
+  // Factory of the most far derivative without ambiguous inheritance.
+  const Factory* FinalFactory(uint32_t base_id) const {
+    const ClassInfo* info = Info(base_id);
+    if (!info) return nullptr;
+    auto it = factories().find(info->final_id);
+    return it != factories().end() ? &it->second : nullptr;
   }
 
   // Creates the most far derivative without ambiguous inheritance.
   Obj* CreateObj(uint32_t base_id) {
-    uint32_t derived_id = base_id;
-    while (true) {
-      auto d = base_to_derived_.find(derived_id);
-      // If the derived is not found or multiple derives are found.
-      if (d == base_to_derived_.end() || d->second.size() > 1) break;
-      derived_id = d->second[0];
-    }
-    auto it = factories_.find(derived_id);
-    if (it == factories_.end()) return nullptr;
-    return it->second.default();
+    const Factory* f = FinalFactory(base_id);
+    return f ? f->create() : nullptr;
   }
   Obj* CreateObj(uint32_t base_id, Obj* parent, Domain* domain) {
-    uint32_t derived_id = base_id;
-    while (true) {
-      auto d = base_to_derived_.find(derived_id);
-      // If the derived is not found or multiple derives are found.
-      if (d == base_to_derived_.end() || d->second.size() > 1) break;
-      derived_id = d->second[0];
+    const Factory* f = FinalFactory(base_id);
+    return f ? f->construct(parent, domain) : nullptr;
+  }
+  Obj* CreateObj(uint32_t base_id, Arena& arena) {
+    const Factory* f = FinalFactory(base_id);
+    if (!f) return nullptr;
+    void* p = arena.Allocate(f->size, f->align);
+    try {
+      return f->place(p);
+    } catch (...) {
+      arena.Free();
+      throw;
+    }
+  }
+  Obj* CreateObj(uint32_t base_id, Obj* parent, Domain* domain, Arena& arena) {
+    const Factory* f = FinalFactory(base_id);
+    if (!f) return nullptr;
+    void* p = arena.Allocate(f->size, f->align);
+    try {
+      return f->place_construct(p, parent, domain);
+    } catch (...) {
+      arena.Free();
+      throw;
     }
-    auto it = factories_.find(derived_id);
-    if (it == factories_.end()) return nullptr;
-    return it->second.construct(parent, domain);
   }
 
-  static Relations& GetRelations() {
-    static Relations relations;
-    return relations;
+  // Returns the immutable snapshot of all registered classes.
+  static std::shared_ptr<const Classes> Snapshot() {
+    std::lock_guard<std::mutex> lock(GetMutex());
+    auto& snapshot = GetSnapshot();
+    if (!snapshot) {
+      auto classes = std::make_shared<Classes>(GetClasses());
+      classes->Build();
+      snapshot = std::move(classes);
+    }
+    return snapshot;
+  }
+
+ private:
+  static Classes& GetClasses() {
+    static Classes classes;
+    return classes;
+  }
+  static std::shared_ptr<const Classes>& GetSnapshot() {
+    static std::shared_ptr<const Classes> snapshot;
+    return snapshot;
+  }
+  static std::mutex& GetMutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+};
+
+void Registry::Classes::Build() {
+  infos_.clear();
+  std::unordered_set<uint32_t> derived;
+  for (const auto& r : base_to_derived_)
+    derived.insert(r.second.begin(), r.second.end());
+  // Base classes are not necessarily registered, e.g. 'aether::Obj'.
+  std::vector<uint32_t> roots;
+  for (const auto& f : factories_)
+    if (derived.find(f.first) == derived.end()) roots.push_back(f.first);
+  for (const auto& r : base_to_derived_)
+    if (derived.find(r.first) == derived.end() &&
+        factories_.find(r.first) == factories_.end())
+      roots.push_back(r.first);
+  // Depth-first traversal from each most base class numbers the classes in
+  // the Euler tour order.
+  int time = 0;
+  std::vector<std::pair<uint32_t, size_t>> stack;
+  auto enter = [this, &time, &stack](uint32_t class_id, const ClassInfo* base) {
+    ClassInfo& info = infos_[class_id];
+    info.tin = time++;
+    info.depth = base ? base->depth + 1 : 0;
+    if (base) info.chain = base->chain;
+    info.chain.push_back(class_id);
+    stack.emplace_back(class_id, 0);
+  };
+  for (auto root : roots) {
+    enter(root, nullptr);
+    while (!stack.empty()) {
+      uint32_t class_id = stack.back().first;
+      size_t next = stack.back().second++;
+      auto d = base_to_derived_.find(class_id);
+      if (d != base_to_derived_.end() && next < d->second.size()) {
+        enter(d->second[next], &infos_[class_id]);
+        continue;
+      }
+      ClassInfo& info = infos_[class_id];
+      info.tout = time++;
+      if (d == base_to_derived_.end()) {
+        info.final_id = info.last_id = class_id;
+      } else {
+        // Derived classes are already visited.
+        const ClassInfo& first = infos_[d->second[0]];
+        info.final_id = d->second.size() > 1 ? class_id : first.final_id;
+        info.last_id = first.last_id;
+      }
+      stack.pop_back();
+    }
+  }
+}
+
+// Objects of a domain with the reference count of the searches. Objects are
+// indexed by pointer and by id so the lookups don't depend on the number of
+// objects in the domain.
+class ObjTable {
+ public:
+  using Entry = std::pair<Obj*, int>;
+  using const_iterator = std::vector<Entry>::const_iterator;
+
+  const_iterator begin() const { return entries_.begin(); }
+  const_iterator end() const { return entries_.end(); }
+  size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+  void clear() {
+    entries_.clear();
+    by_ptr_.clear();
+    by_id_.clear();
+  }
+
+  Entry* Find(const Obj* o) {
+    auto it = by_ptr_.find(o);
+    return it != by_ptr_.end() ? &entries_[it->second] : nullptr;
+  }
+  Obj* Find(const ObjId& obj_id) const {
+    auto it = by_id_.find(obj_id);
+    return it != by_id_.end() ? it->second : nullptr;
+  }
+  inline void Add(Obj* o, int count);
+  inline void Remove(Obj* o);
+  // Changes the object's id keeping the index consistent.
+  inline void SetId(Obj* o, const ObjId& obj_id);
+
+ private:
+  std::vector<Entry> entries_;
+  std::unordered_map<const Obj*, size_t> by_ptr_;
+  std::unordered_map<ObjId, Obj*, ObjId::Hash> by_id_;
+};
+
+// Objects visited by the domains serializing the same graph concurrently.
+class SharedVisited {
+ public:
+  virtual ~SharedVisited() = default;
+  // Returns true if the object is visited for the first time.
+  virtual bool Add(const Obj* o) = 0;
+};
+
+// Dense indices of the objects referenced by the class states of a snapshot.
+// A reference is stored as the varint index of the object and the ids are
+// stored once with the table. Index 0 is the null reference.
+class RefTable {
+ public:
+  RefTable() : ids_(1) {}
+  explicit RefTable(std::vector<ObjId> ids) : ids_(std::move(ids)) {
+    if (ids_.empty() || ids_[0].IsValid()) ids_.insert(ids_.begin(), ObjId{});
+    for (uint32_t i = 1; i < ids_.size(); i++) indices_.emplace(ids_[i], i);
+  }
+
+  // Adds the object to the table. Called concurrently by the serializing
+  // threads.
+  uint32_t Index(const ObjId& obj_id) {
+    if (!obj_id.IsValid()) return 0;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto [it, added] =
+        indices_.try_emplace(obj_id, static_cast<uint32_t>(ids_.size()));
+    if (added) ids_.push_back(obj_id);
+    return it->second;
   }
-  static Factories& GetFactories() {
-    static Factories factories;
-    return factories;
+  // Not synchronized with the adding.
+  const ObjId& Id(uint32_t index) const {
+    if (index >= ids_.size()) {
+      AETHER_THROW(AETHER_TEXT("RefTable: index {0} of {1} objects"), index,
+                   ids_.size());
+    }
+    return ids_[index];
   }
+  const std::vector<ObjId>& ids() const { return ids_; }
+
+ private:
+  std::vector<ObjId> ids_;
+  std::unordered_map<ObjId, uint32_t, ObjId::Hash> indices_;
+  std::mutex mutex_;
 };
 
 class Domain {
@@ -397,25 +823,102 @@ class Domain {
   StoreFacility store_facility_;
   EnumerateFacility enumerate_facility_;
   LoadFacility load_facility_;
-  std::vector<std::pair<Obj*, int>> objects_;
+  // Used if the per-object facilities are not set. Objects are requested in
+  // batches by PrefetchLoader and one by one by the domain.
+  EnumerateBatchFacility enumerate_batch_facility_;
+  LoadBatchFacility load_batch_facility_;
+  // If set then class states are stored with it instead of store_facility_.
+  StoreBuffersFacility store_buffers_facility_;
+  // If set then objects are stored and loaded as packed records instead of
+  // the per-class facilities.
+  StoreObjectFacility store_object_facility_;
+  LoadObjectFacility load_object_facility_;
+  // Encoding of the class states stored and loaded by the domain.
+  Encoding encoding_ = Encoding::kFixed;
+  // If set then the class states of the streams without type indices (untyped
+  // or compact) end with the fingerprint of the field types of the class and
+  // a mismatched class is detected by the loading. The states are not
+  // compatible with the states stored without the fingerprints, and fields
+  // can't be appended to the class.
+  bool schema_fingerprints_ = false;
+  // If set then the serialization stores the changed objects only: unchanged
+  // objects and their references are skipped. Changed objects of the domain
+  // with a stored state are stored too, as they may be referenced by the
+  // unchanged objects only. New objects are stored only if reached from a
+  // stored object, so objects not referenced by the graph leave no states.
+  bool dirty_tracking_ = false;
+  // If set then the first reference to a stored object carries the stored
+  // classes of the object so the loading skips the enumerate facility for it.
+  bool inline_classes_ = false;
+  // If set then references are stored as the indices of the table. All states
+  // of the graph must be stored with the same table.
+  RefTable* ref_table_ = nullptr;
+  // If set then references are loaded as the indices of the table. Shared so
+  // the table outlives the reader it was attached by.
+  std::shared_ptr<const RefTable> load_ref_table_;
+  ObjTable objects_;
   // All newly created objects are added.
   std::vector<Obj*> created_objects_;
+  // Objects created by the domain and not deleted yet.
+  size_t live_objects_ = 0;
+  // Objects created or marked with Obj::MarkDirty and not stored or loaded
+  // since.
+  std::vector<Obj*> dirty_objects_;
 
   int max_depth_ = std::numeric_limits<int>::max();
   int cur_depth_ = 0;
   Domain* parent_;
   Registry registry_;
-  inline static bool manual_release_ = false;
-  inline static bool first_release_ = true;
+  // If set then the objects created by each outermost load are placed into an
+  // arena of their own. The arena is deleted with the last of its objects, so
+  // unloading a loaded subgraph reclaims its memory even if other objects stay.
+  // Objects created outside of loads are allocated on the heap.
+  bool load_arenas_ = false;
+  // The arena of the current load.
+  Arena* arena_ = nullptr;
+  // Loaded bytes viewed by std::string_view and span fields of the objects,
+  // released with the viewing object. Bytes borrowed by the load facilities
+  // are pinned with their owner, bytes borrowed without the owner are viewed
+  // as copies.
+  std::unordered_map<const Obj*, std::vector<AETHER_ISTREAM_CONTAINER>>
+      pinned_;
+  // Objects of the domain whose reference count was decremented but not to
+  // zero. They are the only roots of cycles that could become unreachable.
+  std::vector<Obj*> release_candidates_;
+  // Candidates are collected when the outermost release ends and their number
+  // reaches the threshold. A greater threshold buffers the candidates of many
+  // releases, unreachable cycles stay allocated until the threshold is reached,
+  // CollectCycles() is called or the domain is destroyed.
+  size_t collect_threshold_ = 1;
+  // The domain is in collect_domains_.
+  bool collect_listed_ = false;
+  // The releasing state is per thread so objects of independent domains can be
+  // released in parallel.
+  inline static thread_local bool manual_release_ = false;
+  inline static thread_local bool first_release_ = true;
+  // Domains that got candidates in the current release.
+  inline static thread_local std::vector<Domain*> collect_domains_;
+  // Objects with no references left that are not destroyed yet.
+  inline static thread_local std::vector<Obj*> destroy_queue_;
+  inline static thread_local bool destroying_ = false;
 
   Domain(Domain* parent) : parent_(parent) {}
+  // Buffered cycles may contain objects of the domain.
+  ~Domain() {
+    if (collect_listed_) {
+      collect_domains_.erase(
+          std::remove(collect_domains_.begin(), collect_domains_.end(), this),
+          collect_domains_.end());
+    }
+    if (!release_candidates_.empty() && !manual_release_) CollectCycles();
+  }
   inline Obj* CreateObj(uint32_t cls_id, ObjId obj_id);
   inline Obj* CreateObj(uint32_t cls_id);
   inline Obj* CreateObj(uint32_t cls_id, ObjId obj_id, Obj*);
   inline Obj* CreateObj(uint32_t cls_id, Obj*);
   bool IsLast(uint32_t class_id) const {
-    return registry_.base_to_derived_.find(class_id) ==
-           registry_.base_to_derived_.end();
+    return registry_.base_to_derived().find(class_id) ==
+           registry_.base_to_derived().end();
   }
   bool IsExisting(uint32_t class_id) const {
     return registry_.IsExisting(class_id);
@@ -423,11 +926,7 @@ class Domain {
 
   // Search for the object including parent domains.
   Obj* Find(ObjId obj_id) const {
-    if (auto it =
-            std::find_if(objects_.begin(), objects_.end(),
-                         [&obj_id](auto o) { return o.first->id_ == obj_id; });
-        it != objects_.end())
-      return it->first;
+    if (Obj* o = objects_.Find(obj_id)) return o;
     return parent_ ? parent_->Find(obj_id) : nullptr;
   }
 
@@ -435,21 +934,127 @@ class Domain {
   // searches.
   enum class Result { kFound, kAdded };
   Result FindOrAddObject(Obj* o) {
-    if (auto it = std::find_if(objects_.begin(), objects_.end(),
-                               [o](auto i) { return i.first == o; });
-        it != objects_.end()) {
-      it->second++;
+    if (shared_visited_)
+      return shared_visited_->Add(o) ? Result::kAdded : Result::kFound;
+    if (auto e = objects_.Find(o)) {
+      e->second++;
       return Result::kFound;
     } else {
-      objects_.emplace_back(o, 1);
+      objects_.Add(o, 1);
       created_objects_.push_back(o);
       return Result::kAdded;
     }
   }
-  void RemoveObject(Obj* o) {
-    objects_.erase(std::remove_if(objects_.begin(), objects_.end(),
-                                  [o](auto i) { return i.first == o; }));
+  void RemoveObject(Obj* o) { objects_.Remove(o); }
+  inline void AddDirty(Obj* o);
+  inline void RemoveDirty(Obj* o);
+  // Serializes the changed objects of the domain not serialized yet.
+  inline void SerializeDirty(const Domain& domain);
+
+  struct RecordEntry {
+    uint32_t class_id;
+    uint32_t offset;
+    uint32_t length;
+  };
+
+  // Objects are serialized and loaded with the explicit stack instead of the
+  // recursion through references so the depth of the graph is not limited.
+  // The referenced object is queued with the depth of the reference.
+  inline void SerializeObj(Obj* o);
+  // The state of the created object is loaded after the referencing object.
+  inline void LoadObj(Obj* o, AETHER_IMSTREAM&& record,
+                      std::vector<RecordEntry>&& entries);
+
+  // Per-class state of the object is stored/loaded with the per-class
+  // facilities or collected into the packed record of the object.
+  void BeginStoreObject() {
+    if (!store_object_facility_) return;
+    store_record_.classes_.clear();
+    store_record_.payload_.stream_.clear();
   }
+  inline void StoreClass(const Domain& domain, const ObjId& obj_id,
+                         uint32_t class_id, const AETHER_OMSTREAM& os);
+  inline void EndStoreObject(const Domain& domain, const ObjId& obj_id);
+  // Returns stored classes of the object and the packed record if used.
+  inline std::vector<uint32_t> ReadObject(const ObjId& obj_id,
+                                          AETHER_IMSTREAM& record,
+                                          std::vector<RecordEntry>& entries);
+  inline void LoadClass(const Domain& domain, const ObjId& obj_id,
+                        uint32_t class_id, AETHER_IMSTREAM& is);
+  // Keeps the bytes viewed by the loaded class state of the object.
+  inline void Pin(const Obj* o, AETHER_IMSTREAM& is);
+  void Unpin(const Obj* o) {
+    if (!pinned_.empty()) pinned_.erase(o);
+  }
+
+  // Drops a reference to the object. The object is deleted if no references
+  // left, otherwise it becomes a candidate for the cycle collection. Objects
+  // released by the deleted objects are deleted iteratively.
+  static inline void ReleaseRef(Obj* o);
+  // Deletes the object allocated on the heap or in the arena.
+  static inline void DestroyObj(Obj* o);
+  // Ends the arena of the current load. The arena is deleted when it is empty.
+  inline void CloseArena();
+  static inline void AddReleaseCandidate(Obj* o);
+  static inline void RemoveReleaseCandidate(Obj* o);
+  // Deletes the unreachable cycles with the trial deletion of the buffered
+  // candidates. Only the subgraphs reachable from the candidates are visited.
+  inline void CollectCycles();
+  // Collects the domains whose candidates reached the threshold in the ended
+  // outermost release, or all of them if forced.
+  static inline void CollectReleased(bool force = false);
+
+  struct StoreRecord {
+    std::vector<std::pair<uint32_t, uint32_t>> classes_;
+    AETHER_OMSTREAM payload_;
+  };
+  StoreRecord store_record_;
+  std::vector<std::pair<Obj*, int>> serialize_stack_;
+  bool serializing_ = false;
+  // If set then the serialized objects are tracked with it instead of the
+  // table of the domain.
+  SharedVisited* shared_visited_ = nullptr;
+  // If set then ids of the referenced objects are collected and the objects are
+  // not loaded.
+  std::vector<ObjId>* discovered_ = nullptr;
+  // The loading object is referenced until its state is loaded so releasing
+  // the pointer it was loaded into doesn't delete it.
+  struct PendingLoad {
+    Ptr<Obj> obj_;
+    AETHER_IMSTREAM record_;
+    std::vector<RecordEntry> entries_;
+  };
+  std::vector<PendingLoad> load_stack_;
+  // Drops the reference of the loaded object held by the stack.
+  static inline void ReleaseLoaded(Ptr<Obj>& p);
+  bool loading_ = false;
+  // The packed record of the loading object.
+  PendingLoad* load_record_ = nullptr;
+  // Objects of the domain resolved by the indices of ref_objects_table_. The
+  // slot is filled once per object and cleared when the object is deleted or
+  // its id changes.
+  std::vector<Obj*> ref_objects_;
+  std::shared_ptr<const RefTable> ref_objects_table_;
+  inline Obj* FindRef(uint32_t index);
+  inline void AddRef(Obj* o, uint32_t index);
+  inline void RemoveRef(Obj* o);
+  // Changes the object's id keeping the indices consistent.
+  inline void SetObjId(Obj* o, const ObjId& obj_id);
+
+  // Releases of the scope are collected at once on the scope exit regardless
+  // of the threshold.
+  class DeferredCollection {
+   public:
+    DeferredCollection() : collect_(first_release_) { first_release_ = false; }
+    ~DeferredCollection() {
+      if (!collect_) return;
+      first_release_ = true;
+      CollectReleased(true);
+    }
+
+   private:
+    bool collect_;
+  };
 };
 
 #define AETHER_OBJ(D, B)                                                   \
@@ -468,28 +1073,49 @@ class Domain {
       return id == kClassId ? static_cast<D*>(this) : B::DynamicCast(id);  \
   }                                                                        \
   virtual void Serialize(AETHER_OMSTREAM& s) { Serializator(s); }          \
+  uint32_t ClassSchema() {                                                 \
+    static const uint32_t schema = [this]() {                              \
+      aether::SchemaVisitor v;                                             \
+      Serializator(v);                                                     \
+      return v.schema_;                                                    \
+    }();                                                                   \
+    return schema;                                                         \
+  }                                                                        \
   virtual void SerializeBase(AETHER_OMSTREAM& s) {                         \
     if constexpr (kClassId == kBaseClassId) return;                        \
     AETHER_OMSTREAM os;                                                    \
     os.custom_ = s.custom_;                                                \
+    os.encoding_ = s.encoding_;                                            \
     Serializator(os);                                                      \
-    s.custom_->store_facility_(*domain_, id_, kClassId, os);               \
+    if (!os.has_type_indices() && s.custom_->schema_fingerprints_)         \
+      os.write_schema(ClassSchema());                                      \
+    s.custom_->StoreClass(*domain_, id_, kClassId, os);                    \
     B::SerializeBase(s);                                                   \
   }                                                                        \
   virtual void DeserializeBase(AETHER_IMSTREAM& s) {                       \
     if constexpr (kClassId == kBaseClassId) return;                        \
     AETHER_IMSTREAM is;                                                    \
     is.custom_ = s.custom_;                                                \
-    is.custom_->load_facility_(*domain_, id_, kClassId, is);               \
-    if (!is.stream_.empty()) Serializator(is);                             \
+    is.encoding_ = s.encoding_;                                            \
+    is.custom_->LoadClass(*domain_, id_, kClassId, is);                    \
+    if (!is.stream_.empty()) {                                             \
+      Serializator(is);                                                    \
+      if (!is.has_type_indices() && is.custom_->schema_fingerprints_)      \
+        is.check_schema(ClassSchema());                                    \
+      if (is.views_) is.custom_->Pin(this, is);                            \
+    }                                                                      \
     B::DeserializeBase(s);                                                 \
   }                                                                        \
+  virtual void VisitReferences(aether::RefVisitor& v) {                    \
+    if constexpr (kClassId == kBaseClassId) return;                        \
+    Serializator(v);                                                       \
+    B::VisitReferences(v);                                                 \
+  }                                                                        \
   friend AETHER_OMSTREAM& operator<<(AETHER_OMSTREAM& s, const ptr& o) {   \
-    if (++s.custom_->cur_depth_ <= s.custom_->max_depth_ &&                \
+    if (s.custom_->cur_depth_ < s.custom_->max_depth_ &&                   \
         SerializeRef(s, o) == aether::SerializationResult::kWholeObject) { \
-      o->SerializeBase(s);                                                 \
+      s.custom_->SerializeObj(o.ptr_);                                     \
     }                                                                      \
-    s.custom_->cur_depth_--;                                               \
     return s;                                                              \
   }                                                                        \
   friend AETHER_IMSTREAM& operator>>(AETHER_IMSTREAM& s, ptr& o) {         \
@@ -505,149 +1131,623 @@ class Obj {
       Registry::RegisterClass(
           cls_id, base_id,
           {[]() { return new T(); },
-           [](Obj* parent, Domain* domain) { return new T(parent, domain); }});
+           [](Obj* parent, Domain* domain) { return new T(parent, domain); },
+           [](void* p) { return ::new (p) T(); },
+           [](void* p, Obj* parent, Domain* domain) {
+             return ::new (p) T(parent, domain);
+           },
+           sizeof(T), alignof(T)});
     }
   };
 
  public:
-  virtual ~Obj() { domain_->RemoveObject(this); }
+  virtual ~Obj() {
+    domain_->live_objects_--;
+    domain_->RemoveObject(this);
+    domain_->RemoveDirty(this);
+    domain_->Unpin(this);
+    domain_->RemoveRef(this);
+    Domain::RemoveReleaseCandidate(this);
+  }
   AETHER_OBJ(Obj, Obj);
   Obj() = default;
   Obj(Obj*, Domain*) {}
   template <typename T>
-  void Serializator(T& s) const {}
+  void Serializator(T&) const {}
+
+  // The object is stored with the next serialization if the domain tracks
+  // changes. Created objects are dirty, stored and loaded objects are not.
+  void MarkDirty() { domain_->AddDirty(this); }
+  bool IsDirty() const { return dirty_index_ >= 0; }
 
   ObjId id_;
   ObjFlags flags_;
   int reference_count_ = 0;
   Domain* domain_;
+  // Cycle collection state.
+  enum class Color : uint8_t { kBlack, kGray, kWhite };
+  Color color_ = Color::kBlack;
+  // Position in domain_->release_candidates_ or -1.
+  int candidate_index_ = -1;
+  // The arena of the load that created the object or nullptr for the heap.
+  Arena* arena_ = nullptr;
+  // Position in domain_->ref_objects_ or 0.
+  uint32_t ref_index_ = 0;
+  // Position in Domain::dirty_objects_ or -1.
+  int dirty_index_ = -1;
+  // The object was stored or loaded so it has a stored state.
+  bool persisted_ = false;
 };
 
+void ObjTable::Add(Obj* o, int count) {
+  by_ptr_.emplace(o, entries_.size());
+  by_id_.emplace(o->id_, o);
+  entries_.emplace_back(o, count);
+}
+
+void ObjTable::Remove(Obj* o) {
+  auto it = by_ptr_.find(o);
+  if (it == by_ptr_.end()) return;
+  size_t index = it->second;
+  by_ptr_.erase(it);
+  if (auto i = by_id_.find(o->id_); i != by_id_.end() && i->second == o)
+    by_id_.erase(i);
+  // Move the last entry into the released slot.
+  if (index != entries_.size() - 1) {
+    entries_[index] = entries_.back();
+    by_ptr_[entries_[index].first] = index;
+  }
+  entries_.pop_back();
+}
+
+void ObjTable::SetId(Obj* o, const ObjId& obj_id) {
+  if (by_ptr_.find(o) != by_ptr_.end()) {
+    if (auto i = by_id_.find(o->id_); i != by_id_.end() && i->second == o)
+      by_id_.erase(i);
+    by_id_.emplace(obj_id, o);
+  }
+  o->id_ = obj_id;
+}
+
 Obj* Domain::CreateObj(uint32_t cls_id, ObjId obj_id) {
-  Obj* o = registry_.CreateObj(cls_id);
+  Obj* o = arena_ ? registry_.CreateObj(cls_id, *arena_)
+                  : registry_.CreateObj(cls_id);
   o->id_ = obj_id;
   o->domain_ = this;
-  objects_.emplace_back(o, 1);
+  o->arena_ = arena_;
+  objects_.Add(o, 1);
   created_objects_.push_back(o);
+  live_objects_++;
+  AddDirty(o);
   return o;
 }
 
 Obj* Domain::CreateObj(uint32_t cls_id) {
-  Obj* o = registry_.CreateObj(cls_id);
-  o->id_ = ObjId::GenerateUnique();
-  o->domain_ = this;
-  objects_.emplace_back(o, 1);
-  created_objects_.push_back(o);
-  return o;
+  return CreateObj(cls_id, ObjId::GenerateUnique());
 }
 
 Obj* Domain::CreateObj(uint32_t cls_id, ObjId obj_id, Obj* parent) {
-  Obj* o = registry_.CreateObj(cls_id, parent, this);
+  Obj* o = arena_ ? registry_.CreateObj(cls_id, parent, this, *arena_)
+                  : registry_.CreateObj(cls_id, parent, this);
   o->id_ = obj_id;
   o->domain_ = this;
-  objects_.emplace_back(o, 1);
+  o->arena_ = arena_;
+  objects_.Add(o, 1);
   created_objects_.push_back(o);
+  live_objects_++;
+  AddDirty(o);
   return o;
 }
 
 Obj* Domain::CreateObj(uint32_t cls_id, Obj* parent) {
-  Obj* o = registry_.CreateObj(cls_id, parent, this);
-  o->id_ = ObjId::GenerateUnique();
-  o->domain_ = this;
-  objects_.emplace_back(o, 1);
-  created_objects_.push_back(o);
-  return o;
+  return CreateObj(cls_id, ObjId::GenerateUnique(), parent);
+}
+
+void Domain::SerializeObj(Obj* o) {
+  serialize_stack_.emplace_back(o, cur_depth_ + 1);
+  // Objects referenced while serializing are serialized by the outer call.
+  if (serializing_) return;
+  serializing_ = true;
+  const int depth = cur_depth_;
+  AETHER_OMSTREAM s;
+  s.custom_ = this;
+  s.encoding_ = encoding_;
+  try {
+    while (!serialize_stack_.empty()) {
+      auto [obj, obj_depth] = serialize_stack_.back();
+      serialize_stack_.pop_back();
+      cur_depth_ = obj_depth;
+      // Changed objects referenced by the unchanged object are stored with
+      // SerializeDirty.
+      if (dirty_tracking_ && !obj->IsDirty()) continue;
+      BeginStoreObject();
+      obj->SerializeBase(s);
+      EndStoreObject(*obj->domain_, obj->id_);
+      obj->domain_->RemoveDirty(obj);
+      obj->persisted_ = true;
+    }
+  } catch (...) {
+    serialize_stack_.clear();
+    cur_depth_ = depth;
+    serializing_ = false;
+    throw;
+  }
+  cur_depth_ = depth;
+  serializing_ = false;
+}
+
+void Domain::AddDirty(Obj* o) {
+  if (o->dirty_index_ >= 0) return;
+  o->dirty_index_ = static_cast<int>(dirty_objects_.size());
+  dirty_objects_.push_back(o);
+}
+
+void Domain::RemoveDirty(Obj* o) {
+  if (o->dirty_index_ < 0) return;
+  Obj* last = dirty_objects_.back();
+  dirty_objects_[o->dirty_index_] = last;
+  last->dirty_index_ = o->dirty_index_;
+  dirty_objects_.pop_back();
+  o->dirty_index_ = -1;
+}
+
+void Domain::SerializeDirty(const Domain& domain) {
+  // Stored objects are removed from the list.
+  std::vector<Obj*> dirty = domain.dirty_objects_;
+  for (Obj* o : dirty) {
+    if (o->IsDirty() && o->persisted_ && FindOrAddObject(o) == Result::kAdded)
+      SerializeObj(o);
+  }
+}
+
+void Domain::LoadObj(Obj* o, AETHER_IMSTREAM&& record,
+                     std::vector<RecordEntry>&& entries) {
+  load_stack_.push_back({Ptr<Obj>(o), std::move(record), std::move(entries)});
+  // Objects referenced while loading are loaded by the outer call.
+  if (loading_) return;
+  loading_ = true;
+  // Cycles are not collected while the objects are referenced by the stack.
+  bool first_release = first_release_;
+  first_release_ = false;
+  AETHER_IMSTREAM s;
+  s.custom_ = this;
+  s.encoding_ = encoding_;
+  try {
+    while (!load_stack_.empty()) {
+      PendingLoad pending = std::move(load_stack_.back());
+      load_stack_.pop_back();
+      load_record_ = &pending;
+      Obj* o = pending.obj_.ptr_;
+      o->DeserializeBase(s);
+      o->domain_->RemoveDirty(o);
+      o->persisted_ = true;
+      load_record_ = nullptr;
+      ReleaseLoaded(pending.obj_);
+    }
+  } catch (...) {
+    load_stack_.clear();
+    load_record_ = nullptr;
+    loading_ = false;
+    first_release_ = first_release;
+    if (first_release) CollectReleased(true);
+    throw;
+  }
+  loading_ = false;
+  first_release_ = first_release;
+  if (first_release) CollectReleased();
+}
+
+Obj* Domain::FindRef(uint32_t index) {
+  // Slots of the previous table are dropped.
+  if (ref_objects_table_ != load_ref_table_) {
+    for (Obj* o : ref_objects_) {
+      if (o) o->ref_index_ = 0;
+    }
+    ref_objects_.clear();
+    ref_objects_table_ = load_ref_table_;
+  }
+  return index < ref_objects_.size() ? ref_objects_[index] : nullptr;
+}
+
+void Domain::AddRef(Obj* o, uint32_t index) {
+  // Objects of the parent domains are found by id.
+  if (o->domain_ != this || o->ref_index_) return;
+  if (index >= ref_objects_.size()) ref_objects_.resize(index + 1);
+  ref_objects_[index] = o;
+  o->ref_index_ = index;
+}
+
+void Domain::RemoveRef(Obj* o) {
+  if (!o->ref_index_) return;
+  ref_objects_[o->ref_index_] = nullptr;
+  o->ref_index_ = 0;
+}
+
+void Domain::SetObjId(Obj* o, const ObjId& obj_id) {
+  objects_.SetId(o, obj_id);
+  RemoveRef(o);
+}
+
+void Domain::ReleaseLoaded(Ptr<Obj>& p) {
+  Obj* o = p.ptr_;
+  p.ptr_ = nullptr;
+  // Releases of the pointers to the object while it was loaded made it a
+  // candidate already.
+  if (o->reference_count_ > 1)
+    o->reference_count_--;
+  else
+    ReleaseRef(o);
+}
+
+void Domain::Pin(const Obj* o, AETHER_IMSTREAM& is) {
+  // Moving the containers keeps the bytes in place.
+  auto& pinned = pinned_[o];
+  for (auto& c : is.copies_) pinned.emplace_back(std::move(c));
+  is.copies_.clear();
+  // Borrowed bytes are kept by their owner. Views of the other containers are
+  // copies.
+  if (KeepsViews(is.stream_)) pinned.push_back(std::move(is.stream_));
+}
+
+void Domain::StoreClass(const Domain& domain, const ObjId& obj_id,
+                        uint32_t class_id, const AETHER_OMSTREAM& os) {
+  if (!store_object_facility_) {
+    if (store_buffers_facility_) {
+      store_buffers_facility_(domain, obj_id, class_id, Segments(os.stream_));
+    } else {
+      store_facility_(domain, obj_id, class_id, os);
+    }
+    return;
+  }
+  StoreRecord& r = store_record_;
+  r.classes_.emplace_back(class_id, static_cast<uint32_t>(os.stream_.size()));
+  for (const auto& b : Segments(os.stream_)) r.payload_.write(b.data, b.size);
+}
+
+void Domain::EndStoreObject(const Domain& domain, const ObjId& obj_id) {
+  if (!store_object_facility_) return;
+  StoreRecord& r = store_record_;
+  AETHER_OMSTREAM os;
+  os.custom_ = this;
+  auto write = [&os](uint32_t v) { os.write(&v, sizeof(v)); };
+  write(static_cast<uint32_t>(r.classes_.size()));
+  uint32_t offset = static_cast<uint32_t>(
+      sizeof(uint32_t) + r.classes_.size() * sizeof(uint32_t) * 3);
+  for (const auto& c : r.classes_) {
+    write(c.first);
+    write(offset);
+    write(c.second);
+    offset += c.second;
+  }
+  for (const auto& b : Segments(r.payload_.stream_)) os.write(b.data, b.size);
+  store_object_facility_(domain, obj_id, os);
+}
+
+std::vector<uint32_t> Domain::ReadObject(const ObjId& obj_id,
+                                         AETHER_IMSTREAM& record,
+                                         std::vector<RecordEntry>& entries) {
+  if (!load_object_facility_) {
+    if (enumerate_facility_ || !enumerate_batch_facility_)
+      return enumerate_facility_(*this, obj_id);
+    std::vector<std::pair<ObjId, uint32_t>> states;
+    enumerate_batch_facility_(*this, {obj_id}, states);
+    std::vector<uint32_t> classes;
+    for (const auto& s : states) classes.push_back(s.second);
+    return classes;
+  }
+  record.custom_ = this;
+  load_object_facility_(*this, obj_id, record);
+  std::vector<uint32_t> classes;
+  if (!record.stream_.empty()) {
+    const size_t size = record.stream_.size();
+    auto read = [&record]() {
+      uint32_t v;
+      record.read(&v, sizeof(v));
+      return v;
+    };
+    uint32_t count = read();
+    for (uint32_t i = 0; i < count; i++) {
+      RecordEntry e;
+      e.class_id = read();
+      e.offset = read();
+      e.length = read();
+      entries.push_back(e);
+      classes.push_back(e.class_id);
+    }
+    // Offsets are from the beginning of the record but the record is kept
+    // without the read header.
+    const size_t header = size - record.stream_.size();
+    for (auto& e : entries) {
+      if (e.offset < header || uint64_t{e.offset} + e.length > size) {
+        AETHER_THROW(AETHER_TEXT("Domain: corrupted object record {0}"),
+                     obj_id.ToString());
+      }
+      e.offset -= static_cast<uint32_t>(header);
+    }
+  }
+  return classes;
+}
+
+void Domain::LoadClass(const Domain& domain, const ObjId& obj_id,
+                       uint32_t class_id, AETHER_IMSTREAM& is) {
+  if (!load_object_facility_) {
+    if (load_facility_ || !load_batch_facility_) {
+      load_facility_(domain, obj_id, class_id, is);
+      return;
+    }
+    std::vector<AETHER_IMSTREAM> streams(1);
+    load_batch_facility_(domain, {{obj_id, class_id}}, streams);
+    is.stream_ = std::move(streams[0].stream_);
+    return;
+  }
+  // Views of the class state share the record.
+  PendingLoad& r = *load_record_;
+  for (const auto& e : r.entries_) {
+    if (e.class_id == class_id) {
+      Slice(is.stream_, r.record_.stream_, e.offset, e.length);
+      return;
+    }
+  }
+}
+
+// The reference is written as the id or as the index of the ref table.
+template <class T>
+void WriteRef(T& s, const ObjId& obj_id, ObjFlags flags) {
+  if (RefTable* table = s.custom_->ref_table_) {
+    s.write_type(TypeToIndex<uint32_t>());
+    WriteCompact(s, table->Index(obj_id));
+    s << flags;
+  } else {
+    s << obj_id << flags;
+  }
 }
 
 template <class T, class T1>
 SerializationResult SerializeRef(T& s, const Ptr<T1>& o) {
-  s << o.GetId() << o.GetFlags();
-  if (!o) return SerializationResult::kReferenceOnly;
+  if (!o) {
+    WriteRef(s, o.GetId(), o.GetFlags());
+    return SerializationResult::kReferenceOnly;
+  }
   if (s.custom_->FindOrAddObject(o.ptr_) == Domain::Result::kFound) {
+    WriteRef(s, o.GetId(), o.GetFlags());
     return SerializationResult::kReferenceOnly;
   }
+  // Unloaded references are loaded with Ptr::Load without the classes.
+  ObjFlags flags = o.GetFlags();
+  const Registry::ClassInfo* info =
+      s.custom_->inline_classes_ &&
+              !(flags & (ObjFlags::kUnloadedByDefault | ObjFlags::kUnloaded))
+          ? s.custom_->registry_.Info(o.ptr_->GetClassId())
+          : nullptr;
+  if (!info) {
+    WriteRef(s, o.GetId(), flags);
+    return SerializationResult::kWholeObject;
+  }
+  WriteRef(s, o.GetId(), ObjFlags(flags | ObjFlags::kClassesInline));
+  s << static_cast<uint8_t>(info->chain.size());
+  for (auto c : info->chain) s << c;
   return SerializationResult::kWholeObject;
 }
 
-// FIX: Crashes if multiple domains are used. Track domains correctly.
-template <typename T>
-void Ptr<T>::Release() {
-  if (!ptr_) return;
-  // The pointer is valid but the object is already released in manual releasing
-  // mode. DON'T use 'ptr_'
-  if (Domain::manual_release_) {
-    ptr_ = nullptr;
+void Domain::ReleaseRef(Obj* o) {
+  if (--o->reference_count_ > 0) {
+    AddReleaseCandidate(o);
     return;
   }
-  if (Domain::first_release_) {
-    Domain::first_release_ = false;
-
-    // Collect all objects reachable from the releasing pointer. Count
-    // references for objects.
-    Domain domain(ptr_->domain_);
-    domain.store_facility_ = [](const aether::Domain& domain, const ObjId&,
-                                uint32_t, const AETHER_OMSTREAM&) {};
-    AETHER_OMSTREAM os2;
-    os2.custom_ = &domain;
-    os2 << *this;
-
-    std::vector<Obj*> subgraph;
-    std::vector<Obj*> externally_referenced;
-    for (auto it : domain.objects_) {
-      // Determine if the object is referenced from outside the subgraph.
-      if (it.first->reference_count_ == it.second)
-        subgraph.push_back(it.first);
-      else
-        externally_referenced.push_back(it.first);
-    }
-
-    // Externally referenced objects are not released. Keep all objects
-    // referenced by the externally referenced object.
-    for (auto k : externally_referenced) {
-      domain.objects_.clear();
-      k->Serialize(os2);
-      for (auto it = subgraph.begin(); it != subgraph.end();) {
-        if (std::find_if(domain.objects_.begin(), domain.objects_.end(),
-                         [it](auto i) { return i.first == *it; }) !=
-            domain.objects_.end()) {
-          it = subgraph.erase(it);
-        } else {
-          ++it;
+  // Objects released by the destructor are destroyed by the outer call so
+  // releasing a long chain doesn't recurse.
+  destroy_queue_.push_back(o);
+  if (destroying_) return;
+  destroying_ = true;
+  while (!destroy_queue_.empty()) {
+    Obj* d = destroy_queue_.back();
+    destroy_queue_.pop_back();
+    DestroyObj(d);
+  }
+  destroying_ = false;
+}
+
+void Domain::DestroyObj(Obj* o) {
+  Arena* arena = o->arena_;
+  if (!arena) {
+    delete o;
+    return;
+  }
+  Domain* domain = o->domain_;
+  o->~Obj();
+  if (arena->Free() && arena != domain->arena_) delete arena;
+}
+
+void Domain::CloseArena() {
+  Arena* arena = arena_;
+  arena_ = nullptr;
+  if (arena->live() == 0) delete arena;
+}
+
+// Candidates are kept by the domain of the object so the object released by
+// different threads is removed from the same buffer.
+void Domain::AddReleaseCandidate(Obj* o) {
+  auto& candidates = o->domain_->release_candidates_;
+  if (o->candidate_index_ < 0) {
+    o->candidate_index_ = static_cast<int>(candidates.size());
+    candidates.push_back(o);
+  }
+  if (!o->domain_->collect_listed_) {
+    o->domain_->collect_listed_ = true;
+    collect_domains_.push_back(o->domain_);
+  }
+}
+
+void Domain::RemoveReleaseCandidate(Obj* o) {
+  if (o->candidate_index_ < 0) return;
+  auto& candidates = o->domain_->release_candidates_;
+  Obj* last = candidates.back();
+  candidates[o->candidate_index_] = last;
+  last->candidate_index_ = o->candidate_index_;
+  candidates.pop_back();
+  o->candidate_index_ = -1;
+}
+
+void Domain::CollectReleased(bool force) {
+  std::vector<Domain*> domains;
+  domains.swap(collect_domains_);
+  for (Domain* d : domains) {
+    d->collect_listed_ = false;
+    if (d->release_candidates_.size() >=
+        (force ? 1 : std::max<size_t>(d->collect_threshold_, 1)))
+      d->CollectCycles();
+  }
+}
+
+// Synchronous cycle collection (Bacon, Rajan "Concurrent Cycle Collection in
+// Reference Counted Systems"). References of each candidate's subgraph are
+// subtracted from the reference counts. Objects still referenced from outside
+// the subgraph are restored with everything they reference. Remaining objects
+// are referenced only by each other and are deleted.
+void Domain::CollectCycles() {
+  if (release_candidates_.empty()) return;
+  std::vector<Obj*> roots;
+  roots.swap(release_candidates_);
+  for (auto r : roots) r->candidate_index_ = -1;
+
+  // References of an object are enumerated once per collection. Each
+  // reference is reported once per pointer.
+  std::unordered_map<Obj*, std::vector<Obj*>> references;
+  auto refs = [&references](Obj* o) -> const std::vector<Obj*>& {
+    auto it = references.find(o);
+    if (it != references.end()) return it->second;
+    auto& r = references[o];
+    RefVisitor v([&r](Obj* c) { r.push_back(c); });
+    o->VisitReferences(v);
+    return r;
+  };
+
+  // Subtract internal references.
+  std::vector<Obj*> stack;
+  for (auto r : roots) {
+    if (r->color_ == Obj::Color::kGray) continue;
+    r->color_ = Obj::Color::kGray;
+    stack.push_back(r);
+    while (!stack.empty()) {
+      Obj* o = stack.back();
+      stack.pop_back();
+      for (auto c : refs(o)) {
+        c->reference_count_--;
+        if (c->color_ != Obj::Color::kGray) {
+          c->color_ = Obj::Color::kGray;
+          stack.push_back(c);
         }
       }
     }
+  }
 
-    if (subgraph.empty()) {
-      ptr_->reference_count_--;
-    } else {
-      os2.custom_->max_depth_ = 1;
-      for (auto r : subgraph) {
-        domain.objects_.clear();
-        r->SerializeBase(os2);
-        for (auto k : domain.objects_) {
-          k.first->reference_count_--;
+  // Restore everything reachable from externally referenced objects, mark the
+  // rest as garbage.
+  auto scan_black = [&refs](Obj* o) {
+    std::vector<Obj*> black{o};
+    o->color_ = Obj::Color::kBlack;
+    while (!black.empty()) {
+      Obj* b = black.back();
+      black.pop_back();
+      for (auto c : refs(b)) {
+        c->reference_count_++;
+        if (c->color_ != Obj::Color::kBlack) {
+          c->color_ = Obj::Color::kBlack;
+          black.push_back(c);
         }
       }
-      // Maually release each object without recursive releasing.
-      Domain::manual_release_ = true;
-      for (auto r : subgraph) {
-        delete r;
+    }
+  };
+  for (auto r : roots) {
+    stack.push_back(r);
+    while (!stack.empty()) {
+      Obj* o = stack.back();
+      stack.pop_back();
+      if (o->color_ != Obj::Color::kGray) continue;
+      if (o->reference_count_ > 0) {
+        scan_black(o);
+      } else {
+        o->color_ = Obj::Color::kWhite;
+        for (auto c : refs(o)) stack.push_back(c);
+      }
+    }
+  }
+
+  // Collect the garbage.
+  std::vector<Obj*> garbage;
+  for (auto r : roots) {
+    if (r->color_ != Obj::Color::kWhite) continue;
+    r->color_ = Obj::Color::kBlack;
+    stack.push_back(r);
+    while (!stack.empty()) {
+      Obj* o = stack.back();
+      stack.pop_back();
+      garbage.push_back(o);
+      for (auto c : refs(o)) {
+        if (c->color_ == Obj::Color::kWhite) {
+          c->color_ = Obj::Color::kBlack;
+          stack.push_back(c);
+        }
       }
-      Domain::manual_release_ = false;
     }
-    Domain::first_release_ = true;
-    ptr_ = nullptr;
-    return;
   }
-  if (--ptr_->reference_count_ == 0) delete ptr_;
+  // References between the deleted objects are already subtracted so the
+  // objects are released manually without recursive releasing.
+  bool manual_release = manual_release_;
+  manual_release_ = true;
+  for (auto o : garbage) DestroyObj(o);
+  manual_release_ = manual_release;
+}
+
+template <typename T>
+void Ptr<T>::Release() {
+  if (!ptr_) return;
+  Obj* o = ptr_;
   ptr_ = nullptr;
+  // The pointer is valid but the object is already released in manual releasing
+  // mode. DON'T use 'o'.
+  if (Domain::manual_release_) return;
+  // Releases caused by deleting the object are nested into the first release.
+  if (!Domain::first_release_) {
+    Domain::ReleaseRef(o);
+    return;
+  }
+  Domain::first_release_ = false;
+  Domain::ReleaseRef(o);
+  Domain::first_release_ = true;
+  Domain::CollectReleased();
 }
 
 template <class T>
 Obj::ptr DeserializeRef(T& s) {
   ObjId obj_id;
   ObjFlags obj_flags;
-  s >> obj_id >> obj_flags;
+  uint32_t index = 0;
+  const RefTable* table = s.custom_->load_ref_table_.get();
+  if (table) {
+    s.readTypeAndCheck(TypeToIndex<uint32_t>());
+    ReadCompact(s, index);
+    s >> obj_flags;
+  } else {
+    s >> obj_id >> obj_flags;
+  }
+  std::vector<uint32_t> classes;
+  if (obj_flags & ObjFlags::kClassesInline) {
+    uint8_t count;
+    s >> count;
+    classes.resize(count);
+    for (auto& c : classes) s >> c;
+    obj_flags = obj_flags & (~ObjFlags::kClassesInline);
+  }
+  if (table) {
+    // Objects referenced again are resolved by the index without the lookup.
+    if (index && !(obj_flags & (ObjFlags::kUnloadedByDefault |
+                                ObjFlags::kUnloaded)) &&
+        !s.custom_->discovered_) {
+      if (Obj* o = s.custom_->FindRef(index)) return o;
+    }
+    obj_id = table->Id(index);
+  }
   if (!obj_id.IsValid()) return {};
   if (obj_flags & (ObjFlags::kUnloadedByDefault | ObjFlags::kUnloaded)) {
     Obj::ptr o;
@@ -656,56 +1756,51 @@ Obj::ptr DeserializeRef(T& s) {
     o.SetFlags(obj_flags);
     return o;
   }
+  if (s.custom_->discovered_) {
+    s.custom_->discovered_->push_back(obj_id);
+    return {};
+  }
+  if (!index) return LoadRef(s.custom_, obj_id, obj_flags, std::move(classes));
+  Obj::ptr o = LoadRef(s.custom_, obj_id, obj_flags, std::move(classes));
+  if (o) s.custom_->AddRef(o.ptr_, index);
+  return o;
+}
 
+Obj::ptr LoadRef(Domain* domain, const ObjId& obj_id, ObjFlags obj_flags,
+                 std::vector<uint32_t>&& classes) {
   // If object is already deserialized.
-  Obj* obj = s.custom_->Find(obj_id);
+  Obj* obj = domain->Find(obj_id);
   if (obj) return obj;
 
-  // Find the last class in the inheritance chain.
-  std::vector<uint32_t> classes =
-      s.custom_->enumerate_facility_(*s.custom_, obj_id);
-  // Remove all unsupported classes.
-  for (auto it = classes.begin(); it != classes.end();) {
-    if (s.custom_->IsExisting(*it))
-      ++it;
-    else
-      it = classes.erase(it);
-  }
-  // Build inheritance chain.
-  std::deque<uint32_t> chain;
-  chain.push_back(classes.back());
-  classes.resize(classes.size() - 1);
-  while (!classes.empty()) {
-    for (auto it = classes.begin(); it != classes.end(); ++it) {
-      auto c = *it;
-      int distance = s.custom_->registry_.GenerationDistance(chain.front(), c);
-      if (distance == 1) {
-        chain.push_front(c);
-        classes.erase(it);
-        break;
-      }
-      distance = s.custom_->registry_.GenerationDistance(c, chain.back());
-      if (distance == 1) {
-        chain.push_back(c);
-        classes.erase(it);
-        break;
-      }
-    }
+  // Find the most derived supported class of the stored classes. The packed
+  // record is read even if the classes are inline.
+  AETHER_IMSTREAM record;
+  std::vector<Domain::RecordEntry> entries;
+  if (classes.empty() || domain->load_object_facility_)
+    classes = domain->ReadObject(obj_id, record, entries);
+  const Registry::ClassInfo* info = nullptr;
+  for (auto c : classes) {
+    if (!domain->IsExisting(c)) continue;
+    const Registry::ClassInfo* i = domain->registry_.Info(c);
+    if (!info || i->depth > info->depth) info = i;
   }
-  // Find the Final class for the most derived class provided and create it.
-  for (const auto& f : s.custom_->registry_.factories_) {
-    if (s.custom_->IsLast(f.first)) {
-      int distance =
-          s.custom_->registry_.GenerationDistance(chain.front(), f.first);
-      if (distance >= 0) {
-        obj = s.custom_->CreateObj(f.first, obj_id);
-        obj->flags_ = obj_flags & (~ObjFlags::kUnloaded);
-        obj->DeserializeBase(s);
-        return obj;
-      }
-    }
+  if (!info) return nullptr;
+  // Objects of the outermost load are placed into an arena of their own.
+  bool open_arena = domain->load_arenas_ && !domain->arena_;
+  if (open_arena) domain->arena_ = new Arena();
+  try {
+    // Create the Final class for the most derived class provided. The object
+    // is found by id while its state is loaded.
+    obj = domain->CreateObj(info->last_id, obj_id);
+    obj->flags_ = obj_flags & (~ObjFlags::kUnloaded);
+    Obj::ptr o(obj);
+    domain->LoadObj(obj, std::move(record), std::move(entries));
+    if (open_arena) domain->CloseArena();
+    return o;
+  } catch (...) {
+    if (open_arena) domain->CloseArena();
+    throw;
   }
-  return nullptr;
 }
 
 template <typename T>
@@ -714,9 +1809,17 @@ void Ptr<T>::Serialize() const {
   // serialization.
   Domain domain(ptr_->domain_);
   domain.store_facility_ = ptr_->domain_->store_facility_;
+  domain.store_buffers_facility_ = ptr_->domain_->store_buffers_facility_;
+  domain.store_object_facility_ = ptr_->domain_->store_object_facility_;
+  domain.encoding_ = ptr_->domain_->encoding_;
+  domain.schema_fingerprints_ = ptr_->domain_->schema_fingerprints_;
+  domain.dirty_tracking_ = ptr_->domain_->dirty_tracking_;
+  domain.inline_classes_ = ptr_->domain_->inline_classes_;
+  domain.ref_table_ = ptr_->domain_->ref_table_;
   AETHER_OMSTREAM os;
   os.custom_ = &domain;
   os << *this;
+  if (domain.dirty_tracking_) domain.SerializeDirty(*ptr_->domain_);
 }
 
 template <typename T>
@@ -732,18 +1835,22 @@ void Ptr<T>::Unload() {
 
 template <typename T>
 void Ptr<T>::Load(Domain* domain) {
-  if (ptr_) return;
-  AETHER_IMSTREAM is;
-  is.custom_ = domain;
+  if (ptr_ || !GetId().IsValid()) return;
   // Preserve kUnloadedByDefault flag
   ObjFlags flags = GetFlags() & (~ObjFlags::kUnloaded);
-  AETHER_OMSTREAM os;
-  os << GetId() << ObjFlags(flags & (~ObjFlags::kUnloadedByDefault));
-  is.stream_ = std::move(os.stream_);
   Domain::first_release_ = false;
-  is >> *this;
+  try {
+    *this = LoadRef(domain, GetId(),
+                    ObjFlags(flags & (~ObjFlags::kUnloadedByDefault)), {});
+  } catch (...) {
+    // Cycles of the objects loaded before the error are released.
+    Domain::first_release_ = true;
+    Domain::CollectReleased(true);
+    throw;
+  }
   SetFlags(flags);
   Domain::first_release_ = true;
+  Domain::CollectReleased();
 }
 
 }  // namespace aether
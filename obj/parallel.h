@@ -0,0 +1,189 @@
+// Copyright 2016 Aether authors. All Rights Reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//   http://www.apache.org/licenses/LICENSE-2.0
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef AETHER_PARALLEL_H_
+#define AETHER_PARALLEL_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "obj.h"
+
+namespace aether {
+
+// Set of objects sharded by the pointer so threads rarely wait for each other.
+class ConcurrentVisited : public SharedVisited {
+ public:
+  bool Add(const Obj* o) override {
+    auto h = reinterpret_cast<uintptr_t>(o) * uintptr_t{0x9e3779b97f4a7c15ull};
+    Shard& s = shards_[(h >> 32) % kShards];
+    std::lock_guard<std::mutex> lock(s.mutex_);
+    return s.objects_.insert(o).second;
+  }
+
+ private:
+  static constexpr size_t kShards = 64;
+  struct alignas(64) Shard {
+    std::mutex mutex_;
+    std::unordered_set<const Obj*> objects_;
+  };
+  std::array<Shard, kShards> shards_;
+};
+
+// Serializes the graph with multiple threads. Each thread serializes objects
+// from its own stack with its own domain and streams. Referenced objects are
+// claimed in the shared visited set and stored once. A thread shares the
+// bottom half of its stack with the idle threads. The facilities of the domain
+// are called concurrently and the order of the stored objects varies.
+// The states are the same as stored by Ptr::Serialize. Domains storing inline
+// classes or a ref table are rejected: the reference carrying the classes and
+// the indices of the table depend on the order the threads reach the objects.
+// The threads are started for each serialization and the serializer is used
+// once, so it pays off for large graphs only.
+class ParallelSerializer {
+ public:
+  explicit ParallelSerializer(int threads)
+      : threads_(threads > 0 ? threads : 1) {}
+
+  template <typename T>
+  void Serialize(const Ptr<T>& root) {
+    if (!root) return;
+    Domain* domain = root.ptr_->domain_;
+    if (domain->inline_classes_ || domain->ref_table_) {
+      AETHER_THROW(AETHER_TEXT("ParallelSerializer: {0} threads can't store "
+                               "inline classes or a ref table"),
+                   threads_);
+    }
+    visited_.Add(root.ptr_);
+    queue_.emplace_back(root.ptr_, 1);
+    if (domain->dirty_tracking_) {
+      for (Obj* o : domain->dirty_objects_) {
+        if (o->persisted_ && visited_.Add(o)) queue_.emplace_back(o, 1);
+      }
+    }
+    std::vector<std::vector<Obj*>> stored(threads_);
+    std::vector<std::thread> threads;
+    for (int i = 1; i < threads_; i++) {
+      threads.emplace_back(
+          [this, domain, &stored, i]() { Work(domain, stored[i]); });
+    }
+    Work(domain, stored[0]);
+    for (auto& t : threads) t.join();
+    if (error_) std::rethrow_exception(error_);
+    for (const auto& objects : stored) {
+      for (Obj* o : objects) {
+        o->domain_->RemoveDirty(o);
+        o->persisted_ = true;
+      }
+    }
+  }
+
+ private:
+  void Work(Domain* root_domain, std::vector<Obj*>& stored) {
+    try {
+      Domain domain(root_domain);
+      domain.store_facility_ = root_domain->store_facility_;
+      domain.store_buffers_facility_ = root_domain->store_buffers_facility_;
+      domain.store_object_facility_ = root_domain->store_object_facility_;
+      domain.encoding_ = root_domain->encoding_;
+      domain.schema_fingerprints_ = root_domain->schema_fingerprints_;
+      domain.dirty_tracking_ = root_domain->dirty_tracking_;
+      domain.inline_classes_ = root_domain->inline_classes_;
+      domain.ref_table_ = root_domain->ref_table_;
+      domain.shared_visited_ = &visited_;
+      // Referenced objects are pushed to the stack by SerializeObj.
+      domain.serializing_ = true;
+      AETHER_OMSTREAM s;
+      s.custom_ = &domain;
+      s.encoding_ = domain.encoding_;
+      auto& stack = domain.serialize_stack_;
+      while (Take(stack)) {
+        while (!stack.empty() && !failed_) {
+          auto [obj, obj_depth] = stack.back();
+          stack.pop_back();
+          domain.cur_depth_ = obj_depth;
+          if (domain.dirty_tracking_ && !obj->IsDirty()) continue;
+          domain.BeginStoreObject();
+          obj->SerializeBase(s);
+          domain.EndStoreObject(*obj->domain_, obj->id_);
+          stored.push_back(obj);
+          if (idle_ > 0 && stack.size() > 1) Share(stack);
+        }
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!error_) error_ = std::current_exception();
+      failed_ = true;
+      done_ = true;
+      cv_.notify_all();
+    }
+  }
+
+  // Waits for the shared objects. Returns false if all threads are idle.
+  bool Take(std::vector<std::pair<Obj*, int>>& stack) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_++;
+    while (queue_.empty() && !done_) {
+      if (idle_ == threads_) {
+        done_ = true;
+        cv_.notify_all();
+        break;
+      }
+      cv_.wait(lock);
+    }
+    if (done_) return false;
+    idle_--;
+    size_t count = std::max<size_t>(1, queue_.size() / threads_);
+    stack.insert(stack.end(), queue_.end() - count, queue_.end());
+    queue_.erase(queue_.end() - count, queue_.end());
+    return true;
+  }
+
+  void Share(std::vector<std::pair<Obj*, int>>& stack) {
+    size_t half = stack.size() / 2;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.insert(queue_.end(), stack.begin(), stack.begin() + half);
+    }
+    stack.erase(stack.begin(), stack.begin() + half);
+    cv_.notify_all();
+  }
+
+  const int threads_;
+  ConcurrentVisited visited_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::pair<Obj*, int>> queue_;
+  std::atomic<int> idle_{0};
+  std::atomic<bool> failed_{false};
+  bool done_ = false;
+  std::exception_ptr error_;
+};
+
+template <typename T>
+void SerializeParallel(const Ptr<T>& root, int threads) {
+  ParallelSerializer(threads).Serialize(root);
+}
+
+}  // namespace aether
+
+#endif  // AETHER_PARALLEL_H_
@@ -0,0 +1,329 @@
+// Copyright 2016 Aether authors. All Rights Reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//   http://www.apache.org/licenses/LICENSE-2.0
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef AETHER_PREFETCH_H_
+#define AETHER_PREFETCH_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "obj.h"
+
+namespace aether {
+
+// Fetches stored objects on worker threads ahead of the loading. A worker
+// fetches the classes and the states of the queued objects. The loading domain
+// creates and deserializes the objects on the calling thread and its
+// facilities return the fetched states, waiting for the object if it is not
+// fetched yet. An object waited by the loading is fetched before the other
+// queued objects.
+// With discover_references_ set a worker also reads the states into temporary
+// objects of its own domain which only collect the ids of the referenced
+// objects, and queues them for fetching. So the storage latency is hidden by
+// fetching the graph in parallel and the references are read ahead on
+// multiple cores. Each object is deserialized twice then: once on a worker and
+// once by the loading. So the constructors and Serializators of the loaded
+// classes run on the worker threads concurrently with the loading and must not
+// depend on or change shared state.
+// A worker takes up to batch_size queued objects at once, so with the batch
+// facilities the frontier of the pending references is requested together.
+// The classes may be enumerated in any order. An exception of a batch facility
+// fails the loading of all objects of the batch.
+// A fetched state is moved into the loading stream and is owned by the loading
+// domain from then on, so the views of the loaded objects don't depend on the
+// loader. The states the loading doesn't request are dropped once fetched and
+// the object is forgotten when all its states are taken, so an object loaded
+// again, e.g. after unloading, is fetched again. Objects discovered after
+// their states are taken are not fetched until the workers are idle. States
+// of the objects never loaded are kept until the loader is destroyed. The
+// storage facilities are called concurrently.
+class PrefetchLoader {
+ public:
+  PrefetchLoader(EnumerateBatchFacility enumerate, LoadBatchFacility load,
+                 int threads, size_t batch_size = 256)
+      : enumerate_(std::move(enumerate)),
+        load_(std::move(load)),
+        batch_size_(batch_size > 0 ? batch_size : 1) {
+    for (int i = 0; i < (threads > 0 ? threads : 1); i++)
+      threads_.emplace_back([this]() { Run(); });
+  }
+  // Objects are requested one by one. A worker takes up to batch_size queued
+  // objects at once; by default the objects are spread over the workers so
+  // the requests of the different objects run in parallel.
+  PrefetchLoader(EnumerateFacility enumerate, LoadFacility load, int threads,
+                 size_t batch_size = 1)
+      : PrefetchLoader(
+            [enumerate](const Domain& domain, const std::vector<ObjId>& ids,
+                        std::vector<std::pair<ObjId, uint32_t>>& classes) {
+              for (const auto& id : ids) {
+                for (auto c : enumerate(domain, id))
+                  classes.emplace_back(id, c);
+              }
+            },
+            [load](const Domain& domain,
+                   const std::vector<std::pair<ObjId, uint32_t>>& states,
+                   std::vector<AETHER_IMSTREAM>& streams) {
+              for (size_t i = 0; i < states.size(); i++)
+                load(domain, states[i].first, states[i].second, streams[i]);
+            },
+            threads, batch_size) {}
+  PrefetchLoader(const PrefetchLoader&) = delete;
+  PrefetchLoader& operator=(const PrefetchLoader&) = delete;
+  ~PrefetchLoader() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    queued_.notify_all();
+    for (auto& t : threads_) t.join();
+  }
+
+  // The domain is passed to the storage facilities. Must be attached before
+  // the prefetching.
+  void Attach(Domain& domain) {
+    domain_ = &domain;
+    domain.enumerate_facility_ = [this](const Domain&, const ObjId& obj_id) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      Entry& e = Fetched(lock, obj_id);
+      std::vector<uint32_t> classes = e.classes_;
+      if (e.states_.empty()) Forget(obj_id);
+      return classes;
+    };
+    domain.load_facility_ = [this](const Domain& d, const ObjId& obj_id,
+                                   uint32_t class_id, AETHER_IMSTREAM& is) {
+      Take(d, obj_id, class_id, is);
+    };
+  }
+
+  // Queues the object and the objects referenced by it.
+  void Prefetch(const ObjId& obj_id) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Request(obj_id, false);
+    }
+    queued_.notify_one();
+  }
+
+  // Workers read the fetched states to queue the referenced objects. Must be
+  // set before the prefetching.
+  bool discover_references_ = false;
+
+ private:
+  struct Entry {
+    // The object is in the queue and not taken by a worker yet.
+    bool queued_ = false;
+    bool fetched_ = false;
+    std::vector<uint32_t> classes_;
+    std::vector<std::pair<uint32_t, AETHER_ISTREAM_CONTAINER>> states_;
+    std::exception_ptr error_;
+  };
+
+  // Called with the lock held. Objects waited by the loading are fetched
+  // first: a queued object is queued again at the front and workers skip the
+  // stale position.
+  Entry& Request(const ObjId& obj_id, bool urgent) {
+    auto [it, added] = entries_.try_emplace(obj_id);
+    Entry& e = it->second;
+    if (added || (urgent && e.queued_)) {
+      e.queued_ = true;
+      if (urgent) {
+        queue_.push_front(obj_id);
+      } else {
+        queue_.push_back(obj_id);
+      }
+    }
+    return e;
+  }
+
+  // Called with the lock held when all states of the object are taken.
+  void Forget(const ObjId& obj_id) {
+    entries_.erase(obj_id);
+    taken_.insert(obj_id);
+  }
+
+  // Entries are removed only by the loading thread so the returned entry
+  // remains valid.
+  Entry& Fetched(std::unique_lock<std::mutex>& lock, const ObjId& obj_id) {
+    Entry& e = Request(obj_id, true);
+    queued_.notify_one();
+    fetched_.wait(lock, [&e]() { return e.fetched_; });
+    if (e.error_) std::rethrow_exception(e.error_);
+    return e;
+  }
+
+  // Moves the fetched state into the stream or loads the state taken already.
+  void Take(const Domain& domain, const ObjId& obj_id, uint32_t class_id,
+            AETHER_IMSTREAM& is) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Entry& e = Fetched(lock, obj_id);
+    auto it = std::find_if(e.states_.begin(), e.states_.end(),
+                           [class_id](const auto& s) {
+                             return s.first == class_id;
+                           });
+    const bool fetched = it != e.states_.end();
+    if (fetched) {
+      is.stream_ = std::move(it->second);
+      e.states_.erase(it);
+    }
+    const bool stored = fetched || std::find(e.classes_.begin(),
+                                             e.classes_.end(),
+                                             class_id) != e.classes_.end();
+    if (e.states_.empty()) Forget(obj_id);
+    if (fetched || !stored) return;
+    lock.unlock();
+    std::vector<AETHER_IMSTREAM> streams(1);
+    load_(domain, {{obj_id, class_id}}, streams);
+    is.stream_ = std::move(streams[0].stream_);
+  }
+
+  void Run() {
+    Domain domain(nullptr);
+    std::vector<ObjId> discovered;
+    domain.discovered_ = &discovered;
+    const Entry* reading = nullptr;
+    domain.load_facility_ = [&reading](const Domain&, const ObjId&,
+                                       uint32_t class_id,
+                                       AETHER_IMSTREAM& is) {
+      for (const auto& s : reading->states_) {
+        if (s.first == class_id) {
+          Borrow(is.stream_, s.second.data(), s.second.size());
+          return;
+        }
+      }
+    };
+    std::vector<ObjId> ids;
+    std::vector<Entry*> batch;
+    std::unordered_map<ObjId, Entry*, ObjId::Hash> requested;
+    std::vector<std::pair<ObjId, uint32_t>> states;
+    std::vector<AETHER_IMSTREAM> streams;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      queued_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      if (stop_) return;
+      while (!queue_.empty() && ids.size() < batch_size_) {
+        auto it = entries_.find(queue_.front());
+        queue_.pop_front();
+        if (it == entries_.end() || !it->second.queued_) continue;
+        it->second.queued_ = false;
+        ids.push_back(it->first);
+        batch.push_back(&it->second);
+      }
+      if (ids.empty()) continue;
+      const bool discover = discover_references_;
+      busy_++;
+      lock.unlock();
+      for (size_t i = 0; i < ids.size(); i++) requested.emplace(ids[i], batch[i]);
+      std::exception_ptr error;
+      try {
+        enumerate_(*domain_, ids, states);
+        for (const auto& st : states) {
+          if (requested.find(st.first) == requested.end()) {
+            AETHER_THROW(
+                AETHER_TEXT("PrefetchLoader: object {0} is not requested"),
+                st.first.ToString());
+          }
+        }
+        streams.resize(states.size());
+        load_(*domain_, states, streams);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      for (size_t i = 0; i < states.size() && !error; i++) {
+        Entry& e = *requested[states[i].first];
+        e.classes_.push_back(states[i].second);
+        e.states_.emplace_back(states[i].second, std::move(streams[i].stream_));
+      }
+      requested.clear();
+      for (size_t i = 0; i < ids.size(); i++) {
+        Entry& e = *batch[i];
+        e.error_ = error;
+        if (error) continue;
+        const Registry::ClassInfo* info = nullptr;
+        for (auto c : e.classes_) {
+          if (!domain.IsExisting(c)) continue;
+          const Registry::ClassInfo* info_c = domain.registry_.Info(c);
+          if (!info || info_c->depth > info->depth) info = info_c;
+        }
+        // Only the chain of the created class is requested by the loading.
+        if (!info) {
+          e.states_.clear();
+          continue;
+        }
+        const auto& chain = domain.registry_.Info(info->last_id)->chain;
+        e.states_.erase(
+            std::remove_if(e.states_.begin(), e.states_.end(),
+                           [&chain](const auto& s) {
+                             return std::find(chain.begin(), chain.end(),
+                                              s.first) == chain.end();
+                           }),
+            e.states_.end());
+        if (!discover) continue;
+        try {
+          domain.encoding_ = domain_->encoding_;
+          domain.schema_fingerprints_ = domain_->schema_fingerprints_;
+          domain.load_ref_table_ = domain_->load_ref_table_;
+          reading = &e;
+          Obj::ptr o(domain.CreateObj(info->last_id, ids[i]));
+          AETHER_IMSTREAM s;
+          s.custom_ = &domain;
+          s.encoding_ = domain.encoding_;
+          o->DeserializeBase(s);
+        } catch (...) {
+          e.error_ = std::current_exception();
+        }
+        domain.created_objects_.clear();
+      }
+      ids.clear();
+      states.clear();
+      streams.clear();
+      lock.lock();
+      for (Entry* e : batch) e->fetched_ = true;
+      batch.clear();
+      for (const auto& id : discovered) {
+        if (taken_.find(id) == taken_.end()) Request(id, false);
+      }
+      discovered.clear();
+      // No more references are discovered until an object is requested again.
+      if (--busy_ == 0 && queue_.empty()) taken_.clear();
+      fetched_.notify_all();
+      queued_.notify_all();
+    }
+  }
+
+  EnumerateBatchFacility enumerate_;
+  LoadBatchFacility load_;
+  const size_t batch_size_;
+  Domain* domain_ = nullptr;
+  std::mutex mutex_;
+  std::condition_variable queued_;
+  std::condition_variable fetched_;
+  std::deque<ObjId> queue_;
+  std::unordered_map<ObjId, Entry, ObjId::Hash> entries_;
+  // Objects which states are taken by the loading since the workers were idle.
+  std::unordered_set<ObjId, ObjId::Hash> taken_;
+  int busy_ = 0;
+  bool stop_ = false;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace aether
+
+#endif  // AETHER_PREFETCH_H_
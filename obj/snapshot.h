@@ -0,0 +1,299 @@
+// Copyright 2016 Aether authors. All Rights Reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//   http://www.apache.org/licenses/LICENSE-2.0
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef AETHER_SNAPSHOT_H_
+#define AETHER_SNAPSHOT_H_
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "obj.h"
+
+namespace aether {
+
+// Whole serialized domain in a single file:
+//   Header, Entry * count sorted by (obj_id, class_id), class states
+// Offsets of the class states are from the beginning of the file. If the
+// references are stored as the dense indices then the first entry is the ref
+// table: uint64_t ids of the objects stored as the class 0 of the null id.
+namespace snapshot {
+struct Header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t count;
+};
+struct Entry {
+  uint64_t obj_id;
+  uint32_t class_id;
+  uint32_t length;
+  uint64_t offset;
+};
+constexpr uint32_t kMagic = 0x4e534541;  // "AESN"
+constexpr uint32_t kVersion = 1;
+}  // namespace snapshot
+
+// Collects class states stored by domains and writes them into the snapshot
+// file.
+class SnapshotWriter {
+ public:
+  SnapshotWriter() = default;
+  // References of the states are stored as the indices of the snapshot's ref
+  // table.
+  explicit SnapshotWriter(bool dense_refs) : dense_refs_(dense_refs) {}
+
+  void Attach(Domain& domain) {
+    if (dense_refs_) domain.ref_table_ = &refs_;
+    domain.store_buffers_facility_ =
+        [this](const Domain&, const ObjId& obj_id, uint32_t class_id,
+               const std::vector<segment>& buffers) {
+          Add(obj_id, class_id, buffers);
+        };
+  }
+
+  // The state of the same object's class is replaced.
+  void Add(const ObjId& obj_id, uint32_t class_id, const void* data,
+           size_t size) {
+    Add(obj_id, class_id, {{data, size}});
+  }
+  void Add(const ObjId& obj_id, uint32_t class_id,
+           const std::vector<segment>& buffers) {
+    auto& b = states_[{obj_id.GetValue(), class_id}];
+    b.clear();
+    for (const auto& s : buffers) {
+      b.insert(b.end(), static_cast<const uint8_t*>(s.data),
+               static_cast<const uint8_t*>(s.data) + s.size);
+    }
+  }
+
+  // Returns false if the file can't be written or a class state doesn't fit
+  // the 32-bit length of the entry. The file isn't created then.
+  bool Write(const std::string& path) const {
+    constexpr size_t kMaxLength = std::numeric_limits<uint32_t>::max();
+    if (dense_refs_ && refs_.ids().size() > kMaxLength / sizeof(uint64_t))
+      return false;
+    for (const auto& s : states_) {
+      if (s.second.size() > kMaxLength) return false;
+    }
+    std::vector<uint8_t> table;
+    if (dense_refs_) {
+      table.resize(refs_.ids().size() * sizeof(uint64_t));
+      for (size_t i = 0; i < refs_.ids().size(); i++) {
+        uint64_t id = refs_.ids()[i].GetValue();
+        std::memcpy(table.data() + i * sizeof(id), &id, sizeof(id));
+      }
+    }
+    std::ofstream f(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!f.good()) return false;
+    const uint64_t count = states_.size() + (dense_refs_ ? 1 : 0);
+    snapshot::Header header{snapshot::kMagic, snapshot::kVersion, count};
+    f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    uint64_t offset =
+        sizeof(snapshot::Header) + count * sizeof(snapshot::Entry);
+    auto write_entry = [&f, &offset](uint64_t obj_id, uint32_t class_id,
+                                     const std::vector<uint8_t>& data) {
+      snapshot::Entry e{obj_id, class_id, static_cast<uint32_t>(data.size()),
+                        offset};
+      f.write(reinterpret_cast<const char*>(&e), sizeof(e));
+      offset += data.size();
+    };
+    if (dense_refs_) write_entry(0, 0, table);
+    for (const auto& s : states_)
+      write_entry(s.first.first, s.first.second, s.second);
+    if (dense_refs_)
+      f.write(reinterpret_cast<const char*>(table.data()), table.size());
+    for (const auto& s : states_)
+      f.write(reinterpret_cast<const char*>(s.second.data()), s.second.size());
+    return f.good();
+  }
+
+ private:
+  std::map<std::pair<uint64_t, uint32_t>, std::vector<uint8_t>> states_;
+  bool dense_refs_ = false;
+  RefTable refs_;
+};
+
+// Maps the snapshot file into memory. Class states are read by the streams
+// directly from the mapping. The mapping is shared with the loaded views so it
+// stays mapped after the reader is closed until the viewing objects are
+// released.
+class SnapshotReader {
+ public:
+  SnapshotReader() = default;
+  SnapshotReader(const SnapshotReader&) = delete;
+  SnapshotReader& operator=(const SnapshotReader&) = delete;
+  ~SnapshotReader() { Close(); }
+
+  bool Open(const std::string& path) {
+    Close();
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* p = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                       MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        size_t size = static_cast<size_t>(st.st_size);
+        mapping_.reset(static_cast<const uint8_t*>(p),
+                       [size](const uint8_t* d) {
+                         ::munmap(const_cast<uint8_t*>(d), size);
+                       });
+        data_ = mapping_.get();
+        size_ = size;
+      }
+    }
+    ::close(fd);
+    if (!data_) return false;
+#else
+    std::ifstream f(path, std::ios::in | std::ios::binary);
+    if (!f.good()) return false;
+    f.seekg(0, f.end);
+    auto buffer =
+        std::make_shared<std::vector<uint8_t>>(static_cast<size_t>(f.tellg()));
+    f.seekg(0, f.beg);
+    f.read(reinterpret_cast<char*>(buffer->data()), buffer->size());
+    if (!f.good()) return false;
+    mapping_ = std::shared_ptr<const uint8_t>(buffer, buffer->data());
+    data_ = buffer->data();
+    size_ = buffer->size();
+#endif
+    snapshot::Header header;
+    if (size_ < sizeof(header)) return Close(), false;
+    std::memcpy(&header, data_, sizeof(header));
+    if (header.magic != snapshot::kMagic ||
+        header.version != snapshot::kVersion ||
+        header.count > (size_ - sizeof(header)) / sizeof(snapshot::Entry)) {
+      return Close(), false;
+    }
+    count_ = static_cast<size_t>(header.count);
+    if (count_ > 0 && GetEntry(0).obj_id == 0) {
+      snapshot::Entry e = GetEntry(0);
+      if (e.offset > size_ || e.length > size_ - e.offset)
+        return Close(), false;
+      std::vector<ObjId> ids(e.length / sizeof(uint64_t));
+      for (size_t i = 0; i < ids.size(); i++) {
+        uint64_t id;
+        std::memcpy(&id, data_ + e.offset + i * sizeof(id), sizeof(id));
+        ids[i] = static_cast<ObjId::Type>(id);
+      }
+      refs_ = std::make_shared<const RefTable>(std::move(ids));
+      first_ = 1;
+    }
+    return true;
+  }
+
+  void Close() {
+    mapping_.reset();
+    data_ = nullptr;
+    size_ = 0;
+    count_ = 0;
+    first_ = 0;
+    refs_.reset();
+  }
+
+  bool IsOpen() const { return data_ != nullptr; }
+  size_t size() const { return count_ - first_; }
+
+  // The domain loads the references with the ref table of the snapshot. The
+  // objects are serialized by the domain with the ids. The table remains
+  // attached after the snapshot is closed.
+  void Attach(Domain& domain) const {
+    domain.load_ref_table_ = refs_;
+    domain.enumerate_facility_ = [this](const Domain&, const ObjId& obj_id) {
+      return Enumerate(obj_id);
+    };
+    domain.load_facility_ = [this](const Domain&, const ObjId& obj_id,
+                                   uint32_t class_id, AETHER_IMSTREAM& is) {
+      Load(obj_id, class_id, is);
+    };
+  }
+
+  void Detach(Domain& domain) const {
+    domain.load_ref_table_.reset();
+    domain.enumerate_facility_ = nullptr;
+    domain.load_facility_ = nullptr;
+  }
+
+  std::vector<uint32_t> Enumerate(const ObjId& obj_id) const {
+    std::vector<uint32_t> classes;
+    for (size_t i = LowerBound(obj_id.GetValue(), 0); i < count_; i++) {
+      snapshot::Entry e = GetEntry(i);
+      if (e.obj_id != obj_id.GetValue()) break;
+      classes.push_back(e.class_id);
+    }
+    return classes;
+  }
+
+  // Points the stream to the class state in the mapping.
+  bool Load(const ObjId& obj_id, uint32_t class_id,
+            AETHER_IMSTREAM& is) const {
+    size_t i = LowerBound(obj_id.GetValue(), class_id);
+    if (i == count_) return false;
+    snapshot::Entry e = GetEntry(i);
+    if (e.obj_id != obj_id.GetValue() || e.class_id != class_id) return false;
+    if (e.offset > size_ || e.length > size_ - e.offset) {
+      AETHER_THROW(AETHER_TEXT("SnapshotReader: corrupted entry {0}"),
+                   obj_id.ToString());
+    }
+    Borrow(is.stream_, data_ + e.offset, e.length, mapping_);
+    return true;
+  }
+
+ private:
+  snapshot::Entry GetEntry(size_t i) const {
+    snapshot::Entry e;
+    std::memcpy(&e, data_ + sizeof(snapshot::Header) + i * sizeof(e),
+                sizeof(e));
+    return e;
+  }
+  // Binary search in the sorted index of the mapping.
+  size_t LowerBound(uint64_t obj_id, uint32_t class_id) const {
+    size_t first = first_, count = count_ - first_;
+    while (count > 0) {
+      size_t step = count / 2;
+      snapshot::Entry e = GetEntry(first + step);
+      if (e.obj_id < obj_id || (e.obj_id == obj_id && e.class_id < class_id)) {
+        first += step + 1;
+        count -= step + 1;
+      } else {
+        count = step;
+      }
+    }
+    return first;
+  }
+
+  std::shared_ptr<const uint8_t> mapping_;
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  size_t count_ = 0;
+  // Index of the first class state after the ref table.
+  size_t first_ = 0;
+  std::shared_ptr<const RefTable> refs_;
+};
+
+}  // namespace aether
+
+#endif  // AETHER_SNAPSHOT_H_
@@ -11,6 +11,7 @@
 // =============================================================================
 
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <map>
@@ -445,6 +446,49 @@ void SubgraphReleasing() {
     a1 = nullptr;
     REQUIRE((erased == std::set{1, 2}));
   }
+  {
+    aether::Domain domain{nullptr};
+    A_00::ptr a1(domain.CreateObj(A_00::kClassId, 1));
+    a1->i_ = 1;
+    A_00::ptr a2{a1};
+    A_00::ptr b1{domain.CreateObj(A_00::kClassId, 2)};
+    b1->i_ = 2;
+    A_00::ptr b2{b1};
+
+    a1->a_.reserve(1);
+    a1->a_.push_back(std::move(b1));
+    b2->a_.reserve(1);
+    b2->a_.push_back(std::move(a2));
+
+    erased.clear();
+    {
+      aether::Domain::DeferredCollection deferred;
+      a1 = nullptr;
+      REQUIRE(erased.empty());
+      b2 = nullptr;
+      REQUIRE(erased.empty());
+    }
+    REQUIRE((erased == std::set{1, 2}));
+  }
+  {
+    // Cycles are collected when the number of candidates reaches the threshold.
+    aether::Domain domain{nullptr};
+    domain.collect_threshold_ = 2;
+    std::vector<A_00::ptr> roots;
+    roots.reserve(2);
+    for (int i = 0; i < 2; i++) {
+      A_00::ptr a(domain.CreateObj(A_00::kClassId, 10 + i));
+      a->i_ = 10 + i;
+      a->a_.reserve(1);
+      a->a_.push_back(a);
+      roots.push_back(std::move(a));
+    }
+    erased.clear();
+    roots[0] = nullptr;
+    REQUIRE(erased.empty());
+    roots[1] = nullptr;
+    REQUIRE((erased == std::set{10, 11}));
+  }
 }
 
 void Serialization() {
@@ -632,6 +676,857 @@ void SameObjDiffDomains() {
   }
 }
 
+void VisitReferences() {
+  aether::Domain domain{nullptr};
+  A_00::ptr a(domain.CreateObj(A_00::kClassId, 1));
+  A_00::ptr b(domain.CreateObj(A_00::kClassId, 2));
+  a->a_.push_back(b);
+  a->a_.push_back(A_00::ptr{});
+  a->a_.push_back(b);
+  a->a_.push_back(a);
+  serializator_count = 0;
+  std::vector<aether::Obj*> refs;
+  aether::RefVisitor v([&refs](aether::Obj* o) { refs.push_back(o); });
+  a->VisitReferences(v);
+  REQUIRE(serializator_count == 1);
+  REQUIRE((refs == std::vector<aether::Obj*>{b.ptr_, b.ptr_, a.ptr_}));
+  a->a_.clear();
+}
+
+// One record per object with all classes of the object.
+void PackedRecords() {
+  std::map<aether::ObjId, std::vector<uint8_t>> records;
+  auto object_saver = [&records](const aether::Domain&,
+                                 const aether::ObjId& obj_id,
+                                 const AETHER_OMSTREAM& os) {
+    records[obj_id].assign(os.stream_.begin(), os.stream_.end());
+  };
+  auto object_loader = [&records](const aether::Domain&,
+                                  const aether::ObjId& obj_id,
+                                  AETHER_IMSTREAM& is) {
+    auto it = records.find(obj_id);
+    if (it != records.end())
+      is.stream_.borrow(it->second.data(), it->second.size());
+  };
+  {
+    aether::Domain domain{nullptr};
+    domain.store_object_facility_ = object_saver;
+    A_00::ptr root(domain.CreateObj(A_00::kClassId, 666));
+    root->i_ = 666;
+    root->a_.emplace_back(domain.CreateObj(A_00::kClassId, 1))->i_ = 1;
+    root->a_[0]->a_.push_back(root);
+    V3::ptr v3(domain.CreateObj(V3::kClassId, 3));
+    v3->i = 333;
+    v3->f = 3.33f;
+    v3->s_ = "packed";
+    root.Serialize();
+    v3.Serialize();
+    root->a_[0]->a_.clear();
+  }
+  REQUIRE(records.size() == 3);
+  {
+    aether::Domain domain{nullptr};
+    domain.load_object_facility_ = object_loader;
+    A_00::ptr root;
+    root.SetId(666);
+    root.Load(&domain);
+    REQUIRE(!!root);
+    REQUIRE(root->i_ == 666);
+    REQUIRE(root->a_[0]->i_ == 1);
+    REQUIRE(root->a_[0]->a_[0] == root);
+    root->a_[0]->a_.clear();
+
+    V3::ptr v3;
+    v3.SetId(3);
+    v3.Load(&domain);
+    REQUIRE(!!v3);
+    REQUIRE(v3->i == 333);
+    REQUIRE(v3->f == 3.33f);
+    REQUIRE(v3->s_ == "packed");
+  }
+  {
+    // Downgrade: v3 -> v2
+    aether::Domain domain{nullptr};
+    domain.load_object_facility_ = object_loader;
+    domain.registry_.UnregisterClass(V3::kClassId);
+    V2::ptr v2;
+    v2.SetId(3);
+    v2.Load(&domain);
+    REQUIRE(!!v2);
+    REQUIRE(v2->GetClassId() == V2::kClassId);
+    REQUIRE(v2->i == 333);
+    REQUIRE(v2->f == 3.33f);
+  }
+}
+
+class Fields_05 : public aether::Obj {
+public:
+  AETHER_OBJ(Fields_05, aether::Obj);
+  Fields_05() = default;
+  Fields_05(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & u_ & f_;
+  }
+  uint32_t u_ = 0;
+  float f_ = 1.5f;
+};
+
+class Changed_05 : public aether::Obj {
+public:
+  AETHER_OBJ(Changed_05, aether::Obj);
+  Changed_05() = default;
+  Changed_05(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & s_ & f_;
+  }
+  std::string s_;
+  float f_ = 0;
+};
+
+// The state of a class is read by the class with a different Serializator:
+// bytes are parsed successfully by an untyped stream but the schema differs.
+void SchemaMismatch() {
+  std::map<std::pair<aether::ObjId, uint32_t>, std::vector<uint8_t>> states;
+  {
+    aether::Domain domain{nullptr};
+    domain.schema_fingerprints_ = true;
+    domain.store_facility_ = [&states](const aether::Domain&,
+                                       const aether::ObjId& obj_id,
+                                       uint32_t class_id,
+                                       const AETHER_OMSTREAM& os) {
+      states[{obj_id, class_id}].assign(os.stream_.begin(), os.stream_.end());
+    };
+    Fields_05::ptr o(domain.CreateObj(Fields_05::kClassId, 5));
+    o.Serialize();
+  }
+  // The stored class is replaced with the changed one.
+  aether::Domain domain{nullptr};
+  domain.schema_fingerprints_ = true;
+  domain.enumerate_facility_ = [](const aether::Domain&, const aether::ObjId&) {
+    return std::vector<uint32_t>{Changed_05::kClassId};
+  };
+  domain.load_facility_ = [&states](const aether::Domain&,
+                                    const aether::ObjId& obj_id, uint32_t,
+                                    AETHER_IMSTREAM& is) {
+    auto& s = states[{obj_id, Fields_05::kClassId}];
+    is.stream_.borrow(s.data(), s.size());
+  };
+  Changed_05::ptr o;
+  o.SetId(5);
+  bool thrown = false;
+  try {
+    o.Load(&domain);
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  REQUIRE(thrown);
+}
+
+class Appended_05 : public aether::Obj {
+public:
+  AETHER_OBJ(Appended_05, aether::Obj);
+  Appended_05() = default;
+  Appended_05(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & u_ & f_;
+    // The field appended to the class is missing in the older states.
+    if constexpr (std::is_base_of<aether::istream, T>::value) {
+      if (s.stream_.empty()) return;
+    }
+    s & ints_;
+  }
+  uint32_t u_ = 0;
+  float f_ = 0;
+  std::vector<int> ints_{-1};
+};
+
+// The fingerprint depends on the field types only. The states stored without
+// the fingerprints are loaded by a class with the appended fields.
+void Fingerprints() {
+  std::map<std::pair<aether::ObjId, uint32_t>, std::vector<uint8_t>> states;
+  auto store = [&states](aether::Domain& domain) {
+    domain.store_facility_ = [&states](const aether::Domain&,
+                                       const aether::ObjId& obj_id,
+                                       uint32_t class_id,
+                                       const AETHER_OMSTREAM& os) {
+      states[{obj_id, class_id}].assign(os.stream_.begin(), os.stream_.end());
+    };
+  };
+  {
+    aether::Domain domain{nullptr};
+    domain.encoding_ = aether::Encoding::kCompact;
+    domain.schema_fingerprints_ = true;
+    store(domain);
+    Appended_05::ptr a(domain.CreateObj(Appended_05::kClassId, 1));
+    Appended_05::ptr b(domain.CreateObj(Appended_05::kClassId, 2));
+    b->u_ = 1000;
+    b->ints_ = {1, 2, 3, 4, 5};
+    a.Serialize();
+    b.Serialize();
+    auto& sa = states[{1, Appended_05::kClassId}];
+    auto& sb = states[{2, Appended_05::kClassId}];
+    REQUIRE(sa.size() != sb.size());
+    REQUIRE(std::equal(sa.end() - 4, sa.end(), sb.end() - 4));
+  }
+  {
+    aether::Domain domain{nullptr};
+    store(domain);
+    Fields_05::ptr o(domain.CreateObj(Fields_05::kClassId, 5));
+    o->u_ = 7;
+    o.Serialize();
+  }
+  aether::Domain domain{nullptr};
+  domain.enumerate_facility_ = [](const aether::Domain&, const aether::ObjId&) {
+    return std::vector<uint32_t>{Appended_05::kClassId};
+  };
+  domain.load_facility_ = [&states](const aether::Domain&,
+                                    const aether::ObjId& obj_id, uint32_t,
+                                    AETHER_IMSTREAM& is) {
+    auto& s = states[{obj_id, Fields_05::kClassId}];
+    is.stream_.borrow(s.data(), s.size());
+  };
+  Appended_05::ptr o;
+  o.SetId(5);
+  o.Load(&domain);
+  REQUIRE(!!o);
+  REQUIRE(o->u_ == 7 && o->f_ == 1.5f);
+  REQUIRE(o->ints_ == std::vector<int>{-1});
+}
+
+class Packed_05 : public aether::Obj {
+public:
+  AETHER_OBJ(Packed_05, aether::Obj);
+  Packed_05() = default;
+  Packed_05(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & aether::pack(u_, f_) & s_;
+  }
+  uint32_t u_ = 0;
+  float f_ = 0;
+  std::string s_;
+};
+
+class Swapped_05 : public aether::Obj {
+public:
+  AETHER_OBJ(Swapped_05, aether::Obj);
+  Swapped_05() = default;
+  Swapped_05(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & aether::pack(f_, u_) & s_;
+  }
+  float f_ = 0;
+  uint32_t u_ = 0;
+  std::string s_;
+};
+
+// Packed fields are loaded as a block. The block of the same size with other
+// types is detected by the typed streams and by the fingerprint of the untyped
+// states.
+void PackMismatch() {
+  std::map<std::pair<aether::ObjId, uint32_t>, std::vector<uint8_t>> states;
+  {
+    aether::Domain domain{nullptr};
+    domain.schema_fingerprints_ = true;
+    domain.store_facility_ = [&states](const aether::Domain&,
+                                       const aether::ObjId& obj_id,
+                                       uint32_t class_id,
+                                       const AETHER_OMSTREAM& os) {
+      states[{obj_id, class_id}].assign(os.stream_.begin(), os.stream_.end());
+    };
+    Packed_05::ptr o(domain.CreateObj(Packed_05::kClassId, 5));
+    o->u_ = 7;
+    o->f_ = 2.5f;
+    o->s_ = "packed";
+    o.Serialize();
+  }
+  auto load = [&states](aether::Domain& domain, uint32_t class_id) {
+    domain.schema_fingerprints_ = true;
+    domain.enumerate_facility_ = [class_id](const aether::Domain&,
+                                            const aether::ObjId&) {
+      return std::vector<uint32_t>{class_id};
+    };
+    domain.load_facility_ = [&states](const aether::Domain&,
+                                      const aether::ObjId& obj_id, uint32_t,
+                                      AETHER_IMSTREAM& is) {
+      auto& s = states[{obj_id, Packed_05::kClassId}];
+      is.stream_.borrow(s.data(), s.size());
+    };
+  };
+  {
+    aether::Domain domain{nullptr};
+    load(domain, Packed_05::kClassId);
+    Packed_05::ptr o;
+    o.SetId(5);
+    o.Load(&domain);
+    REQUIRE(o->u_ == 7 && o->f_ == 2.5f && o->s_ == "packed");
+  }
+  aether::Domain domain{nullptr};
+  load(domain, Swapped_05::kClassId);
+  Swapped_05::ptr o;
+  o.SetId(5);
+  bool thrown = false;
+  try {
+    o.Load(&domain);
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  REQUIRE(thrown);
+}
+
+class Baseline_05 : public aether::Obj {
+public:
+  AETHER_OBJ(Baseline_05, aether::Obj);
+  Baseline_05() = default;
+  Baseline_05(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & i_ & s_ & v_ & m_ & refs_;
+  }
+  int32_t i_ = 0;
+  std::string s_;
+  std::vector<float> v_;
+  std::map<int, std::string> m_;
+  std::vector<Baseline_05::ptr> refs_;
+};
+
+// States stored by the typed streams before the schema fingerprints were added
+// are loaded and stored unchanged. The 32-bit ids of the states are loaded with
+// the wider ids too.
+void BaselineStates() {
+  constexpr bool typed =
+      std::is_same<AETHER_IMSTREAM, aether::timstream<aether::Domain*>>::value;
+  if (!typed) return;
+  const std::map<std::pair<aether::ObjId, uint32_t>, std::vector<uint8_t>>
+      stored = {
+          {{1, Baseline_05::kClassId},
+           {9,  7,   0,  0, 0,  19, 10, 0, 0,  0,   0, 254, 16,
+            10, 0,   0,  0, 0,  253, 9, 19, 10, 0,  0, 0,   0,
+            255, 10, 1,  0, 0,  0,  10, 154, 2, 0, 0, 4,   0}},
+          {{666, Baseline_05::kClassId},
+           {9,   251, 255, 255, 255, 19,  10,  8,  0,  0,   0,  98,  97,
+            115, 101, 108, 105, 110, 101, 254, 16, 10, 2,   0,  0,   0,
+            0,   0,   192, 63,  0,   0,   32,  64, 253, 9,  19,  10,  2,
+            0,   0,   0,   9,   1,   0,   0,   0,   19, 10, 3,   0,   0,
+            0,   111, 110, 101, 9,   2,   0,   0,   0,  19, 10,  3,   0,
+            0,   0,   116, 119, 111, 255, 10,  2,   0,  0,  0,   10,  1,
+            0,   0,   0,   4,   0,   10,  1,   0,   0,  0,  4,   0}}};
+  std::map<std::pair<aether::ObjId, uint32_t>, std::vector<uint8_t>> states;
+  {
+    aether::Domain domain{nullptr};
+    domain.enumerate_facility_ = [](const aether::Domain&,
+                                    const aether::ObjId&) {
+      return std::vector<uint32_t>{Baseline_05::kClassId};
+    };
+    domain.load_facility_ = [&stored](const aether::Domain&,
+                                      const aether::ObjId& obj_id,
+                                      uint32_t class_id, AETHER_IMSTREAM& is) {
+      auto& s = stored.at({obj_id, class_id});
+      is.stream_.borrow(s.data(), s.size());
+    };
+    domain.store_facility_ = [&states](const aether::Domain&,
+                                       const aether::ObjId& obj_id,
+                                       uint32_t class_id,
+                                       const AETHER_OMSTREAM& os) {
+      states[{obj_id, class_id}].assign(os.stream_.begin(), os.stream_.end());
+    };
+    Baseline_05::ptr root;
+    root.SetId(666);
+    root.Load(&domain);
+    REQUIRE(!!root);
+    REQUIRE(root->i_ == -5);
+    REQUIRE(root->s_ == "baseline");
+    REQUIRE((root->v_ == std::vector<float>{1.5f, 2.5f}));
+    REQUIRE((root->m_ == std::map<int, std::string>{{1, "one"}, {2, "two"}}));
+    REQUIRE(root->refs_.size() == 2);
+    REQUIRE(root->refs_[0] == root->refs_[1]);
+    REQUIRE(root->refs_[0]->i_ == 7);
+    REQUIRE(root->refs_[0]->refs_[0] == root);
+    root.Serialize();
+  }
+  if (sizeof(aether::ObjId::Type) == sizeof(uint32_t))
+    REQUIRE(states == stored);
+}
+
+class Containers_05 : public aether::Obj {
+public:
+  AETHER_OBJ(Containers_05, aether::Obj);
+  Containers_05() = default;
+  Containers_05(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & map_ & deque_ & unordered_ & ints_ & strings_ & array_ & names_ &
+        optional_ & empty_ & pair_ & tuple_ & variant_ & ref_variant_;
+  }
+  std::map<int, std::string> map_;
+  std::deque<std::string> deque_;
+  std::unordered_map<int, Containers_05::ptr> unordered_;
+  std::set<int> ints_;
+  std::set<std::string> strings_;
+  std::array<int, 3> array_{};
+  std::array<std::string, 2> names_;
+  std::optional<Containers_05::ptr> optional_;
+  std::optional<int> empty_;
+  std::pair<int, std::string> pair_;
+  std::tuple<int, std::string, Containers_05::ptr> tuple_;
+  std::variant<int, std::string> variant_;
+  std::variant<int, Containers_05::ptr> ref_variant_;
+};
+
+void Containers() {
+  std::map<std::pair<aether::ObjId, uint32_t>, std::vector<uint8_t>> states;
+  auto attach = [&states](aether::Domain& domain) {
+    domain.store_facility_ = [&states](const aether::Domain&,
+                                       const aether::ObjId& obj_id,
+                                       uint32_t class_id,
+                                       const AETHER_OMSTREAM& os) {
+      states[{obj_id, class_id}].assign(os.stream_.begin(), os.stream_.end());
+    };
+    domain.enumerate_facility_ = [](const aether::Domain&,
+                                    const aether::ObjId&) {
+      return std::vector<uint32_t>{Containers_05::kClassId};
+    };
+    domain.load_facility_ = [&states](const aether::Domain&,
+                                      const aether::ObjId& obj_id,
+                                      uint32_t class_id, AETHER_IMSTREAM& is) {
+      auto& s = states[{obj_id, class_id}];
+      is.stream_.borrow(s.data(), s.size());
+    };
+  };
+  {
+    aether::Domain domain{nullptr};
+    attach(domain);
+    Containers_05::ptr root(domain.CreateObj(Containers_05::kClassId, 666));
+    Containers_05::ptr a(domain.CreateObj(Containers_05::kClassId, 1));
+    Containers_05::ptr b(domain.CreateObj(Containers_05::kClassId, 2));
+    root->map_ = {{3, "three"}, {1, "one"}, {2, "two"}};
+    root->deque_ = {"a", "b"};
+    root->unordered_ = {{1, a}, {2, b}};
+    root->ints_ = {5, 3, 9};
+    root->strings_ = {"y", "x"};
+    root->array_ = {7, 8, 9};
+    root->names_ = {"first", "second"};
+    root->optional_ = a;
+    root->pair_ = {4, "four"};
+    root->tuple_ = {5, "five", b};
+    root->variant_ = std::string("variant");
+    root->ref_variant_ = root;
+    b->optional_ = root;
+    // References in all containers are reported to the collector.
+    std::vector<aether::Obj*> refs;
+    aether::RefVisitor v([&refs](aether::Obj* o) { refs.push_back(o); });
+    root->VisitReferences(v);
+    REQUIRE(refs.size() == 5);
+    root.Serialize();
+    root->ref_variant_ = 0;
+    b->optional_.reset();
+  }
+  aether::Domain domain{nullptr};
+  attach(domain);
+  Containers_05::ptr root;
+  root.SetId(666);
+  root.Load(&domain);
+  REQUIRE(!!root);
+  REQUIRE((root->map_ ==
+           std::map<int, std::string>{{1, "one"}, {2, "two"}, {3, "three"}}));
+  REQUIRE((root->deque_ == std::deque<std::string>{"a", "b"}));
+  REQUIRE(root->unordered_.size() == 2);
+  REQUIRE(root->unordered_[1] == *root->optional_);
+  REQUIRE((root->ints_ == std::set<int>{3, 5, 9}));
+  REQUIRE((root->strings_ == std::set<std::string>{"x", "y"}));
+  REQUIRE((root->array_ == std::array<int, 3>{7, 8, 9}));
+  REQUIRE(root->names_[1] == "second");
+  REQUIRE(!root->empty_);
+  REQUIRE(root->pair_.second == "four");
+  REQUIRE(std::get<1>(root->tuple_) == "five");
+  REQUIRE(std::get<2>(root->tuple_) == root->unordered_[2]);
+  REQUIRE(std::get<2>(root->tuple_)->optional_ == root);
+  REQUIRE(std::get<std::string>(root->variant_) == "variant");
+  REQUIRE(std::get<Containers_05::ptr>(root->ref_variant_) == root);
+  std::get<2>(root->tuple_)->optional_.reset();
+  root->ref_variant_ = 0;
+}
+
+// Containers are read into the filled ones: a vector takes the stored size
+// unless it is empty and a deque is appended to.
+void FilledContainers() {
+  AETHER_OMSTREAM os;
+  os << std::vector<std::string>{} << std::vector<std::string>{"a", "b"}
+     << std::deque<std::string>{"c"};
+  AETHER_IMSTREAM is;
+  is.stream_.borrow(os.stream_.data(), os.stream_.size());
+  std::vector<std::string> empty{"kept"};
+  std::vector<std::string> two{"x", "y", "z"};
+  std::deque<std::string> deque{"b"};
+  is >> empty >> two >> deque;
+  REQUIRE(empty == std::vector<std::string>{"kept"});
+  REQUIRE((two == std::vector<std::string>{"a", "b"}));
+  REQUIRE((deque == std::deque<std::string>{"b", "c"}));
+}
+
+class View_05 : public aether::Obj {
+public:
+  AETHER_OBJ(View_05, aether::Obj);
+  View_05() = default;
+  View_05(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & name_ & ints_ & doubles_ & names_;
+  }
+  std::string_view name_;
+  aether::span<int32_t> ints_;
+  aether::span<double> doubles_;
+  // Containers of views are written as the viewed elements.
+  std::vector<std::string_view> names_;
+};
+
+// Views point into the loaded bytes: owned bytes are pinned by the domain and
+// bytes borrowed with the owner are read without copying.
+void Views() {
+  const std::string name = "odd";
+  const std::vector<int32_t> ints = {1, 2, 3};
+  const std::vector<double> doubles = {0.5, 1.5};
+  std::map<std::pair<aether::ObjId, uint32_t>, std::vector<uint8_t>> states;
+  std::map<aether::ObjId, std::vector<uint8_t>> records;
+  {
+    aether::Domain domain{nullptr};
+    domain.store_facility_ = [&states](const aether::Domain&,
+                                       const aether::ObjId& obj_id,
+                                       uint32_t class_id,
+                                       const AETHER_OMSTREAM& os) {
+      states[{obj_id, class_id}].assign(os.stream_.begin(), os.stream_.end());
+    };
+    View_05::ptr o(domain.CreateObj(View_05::kClassId, 7));
+    o->name_ = name;
+    o->ints_ = ints;
+    o->doubles_ = doubles;
+    const std::string first = "first";
+    const std::string second = "second";
+    o->names_ = {first, second};
+    o.Serialize();
+    domain.store_facility_ = nullptr;
+    domain.store_object_facility_ = [&records](const aether::Domain&,
+                                               const aether::ObjId& obj_id,
+                                               const AETHER_OMSTREAM& os) {
+      records[obj_id].assign(os.stream_.begin(), os.stream_.end());
+    };
+    o.Serialize();
+  }
+  auto check = [&](const View_05::ptr& o) {
+    REQUIRE(!!o);
+    REQUIRE(o->name_ == name);
+    REQUIRE((std::vector<int32_t>(o->ints_.begin(), o->ints_.end()) == ints));
+    REQUIRE(o->doubles_.size() == 2 && o->doubles_[1] == 1.5);
+    REQUIRE((o->names_ == std::vector<std::string_view>{"first", "second"}));
+  };
+  const auto& state = states[{aether::ObjId{7}, View_05::kClassId}];
+  REQUIRE(std::string(state.begin(), state.end()).find("second") !=
+          std::string::npos);
+  auto enumerate = [](const aether::Domain&, const aether::ObjId&) {
+    return std::vector<uint32_t>{View_05::kClassId};
+  };
+  {
+    // The copied state is pinned after the loader's copy is gone.
+    aether::Domain domain{nullptr};
+    domain.enumerate_facility_ = enumerate;
+    domain.load_facility_ = [&states](const aether::Domain&,
+                                      const aether::ObjId& obj_id,
+                                      uint32_t class_id, AETHER_IMSTREAM& is) {
+      is.stream_ = std::vector<uint8_t>(states[{obj_id, class_id}]);
+    };
+    View_05::ptr o;
+    o.SetId(7);
+    o.Load(&domain);
+    check(o);
+    REQUIRE(domain.pinned_.size() == 1);
+    // The pinned bytes are released with the object.
+    o = nullptr;
+    REQUIRE(domain.pinned_.empty());
+  }
+  {
+    // The copied packed record is pinned.
+    aether::Domain domain{nullptr};
+    domain.load_object_facility_ = [&records](const aether::Domain&,
+                                              const aether::ObjId& obj_id,
+                                              AETHER_IMSTREAM& is) {
+      is.stream_ = std::vector<uint8_t>(records[obj_id]);
+    };
+    View_05::ptr o;
+    o.SetId(7);
+    o.Load(&domain);
+    check(o);
+    REQUIRE(domain.pinned_.size() == 1);
+    // The pinned bytes are released with the object.
+    o = nullptr;
+    REQUIRE(domain.pinned_.empty());
+  }
+  {
+    // State borrowed with the owner is viewed in place, only misaligned
+    // elements are copied. The owner is kept with the object.
+    auto s = std::make_shared<std::vector<uint8_t>>(
+        states[{aether::ObjId{7}, View_05::kClassId}]);
+    aether::Domain domain{nullptr};
+    domain.enumerate_facility_ = enumerate;
+    domain.load_facility_ = [&s](const aether::Domain&, const aether::ObjId&,
+                                 uint32_t, AETHER_IMSTREAM& is) {
+      is.stream_.borrow(s->data(), s->size(), s);
+    };
+    View_05::ptr o;
+    o.SetId(7);
+    o.Load(&domain);
+    std::weak_ptr<std::vector<uint8_t>> owner = s;
+    const uint8_t* begin = s->data();
+    const uint8_t* end = begin + s->size();
+    s.reset();
+    REQUIRE(!owner.expired());
+    check(o);
+    auto p = reinterpret_cast<const uint8_t*>(o->name_.data());
+    REQUIRE(p >= begin && p + name.size() <= end);
+    o = nullptr;
+    REQUIRE(owner.expired());
+  }
+  {
+    // State borrowed without the owner is viewed as a copy.
+    auto& s = states[{aether::ObjId{7}, View_05::kClassId}];
+    aether::Domain domain{nullptr};
+    domain.enumerate_facility_ = enumerate;
+    domain.load_facility_ = [&s](const aether::Domain&, const aether::ObjId&,
+                                 uint32_t, AETHER_IMSTREAM& is) {
+      is.stream_.borrow(s.data(), s.size());
+    };
+    View_05::ptr o;
+    o.SetId(7);
+    o.Load(&domain);
+    check(o);
+    auto p = reinterpret_cast<const uint8_t*>(o->name_.data());
+    REQUIRE(p < s.data() || p >= s.data() + s.size());
+  }
+}
+
+// Only changed objects are stored including the ones referenced by unchanged
+// objects only.
+void DirtyTracking() {
+  std::map<std::pair<aether::ObjId, uint32_t>, std::vector<uint8_t>> states;
+  std::set<aether::ObjId> stored;
+  auto attach = [&](aether::Domain& domain) {
+    domain.dirty_tracking_ = true;
+    domain.store_facility_ = [&](const aether::Domain&,
+                                 const aether::ObjId& obj_id,
+                                 uint32_t class_id,
+                                 const AETHER_OMSTREAM& os) {
+      stored.insert(obj_id);
+      states[{obj_id, class_id}].assign(os.stream_.begin(), os.stream_.end());
+    };
+    domain.enumerate_facility_ = [](const aether::Domain&,
+                                    const aether::ObjId&) {
+      return std::vector<uint32_t>{A_00::kClassId};
+    };
+    domain.load_facility_ = [&states](const aether::Domain&,
+                                      const aether::ObjId& obj_id,
+                                      uint32_t class_id, AETHER_IMSTREAM& is) {
+      auto& s = states[{obj_id, class_id}];
+      is.stream_.borrow(s.data(), s.size());
+    };
+  };
+  {
+    aether::Domain domain{nullptr};
+    attach(domain);
+    A_00::ptr root(domain.CreateObj(A_00::kClassId, 666));
+    A_00::ptr a(domain.CreateObj(A_00::kClassId, 1));
+    A_00::ptr b(domain.CreateObj(A_00::kClassId, 2));
+    root->a_.push_back(a);
+    a->a_.push_back(b);
+    b->a_.push_back(root);
+    root.Serialize();
+    REQUIRE(stored.size() == 3);
+    REQUIRE(!root->IsDirty());
+
+    stored.clear();
+    root.Serialize();
+    REQUIRE(stored.empty());
+
+    // The changed object is referenced by the unchanged ones.
+    b->i_ = 22;
+    b->MarkDirty();
+    root.Serialize();
+    REQUIRE((stored == std::set<aether::ObjId>{2}));
+    b->a_.clear();
+  }
+  aether::Domain domain{nullptr};
+  attach(domain);
+  A_00::ptr root;
+  root.SetId(666);
+  root.Load(&domain);
+  REQUIRE(!!root);
+  A_00::ptr b = root->a_[0]->a_[0];
+  REQUIRE(b->i_ == 22);
+  stored.clear();
+  root.Serialize();
+  REQUIRE(stored.empty());
+
+  // The new object is stored with the changed referencing object.
+  b->a_.clear();
+  b->a_.emplace_back(domain.CreateObj(A_00::kClassId, 3))->i_ = 3;
+  b->MarkDirty();
+  root.Serialize();
+  REQUIRE((stored == std::set<aether::ObjId>{2, 3}));
+
+  // New objects not referenced by the stored graph leave no states.
+  A_00::ptr orphan(domain.CreateObj(A_00::kClassId, 4));
+  orphan->i_ = 4;
+  stored.clear();
+  root.Serialize();
+  REQUIRE(stored.empty());
+  b->a_.push_back(orphan);
+  b->MarkDirty();
+  root.Serialize();
+  REQUIRE((stored == std::set<aether::ObjId>{2, 4}));
+  orphan = nullptr;
+  b = nullptr;
+  root = nullptr;
+
+  aether::Domain loaded{nullptr};
+  attach(loaded);
+  root.SetId(666);
+  root.Load(&loaded);
+  REQUIRE(root->a_[0]->a_[0]->a_[0]->i_ == 3);
+}
+
+class Inline_05 : public aether::Obj {
+public:
+  AETHER_OBJ(Inline_05, aether::Obj);
+  Inline_05() = default;
+  Inline_05(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) { s & v_; }
+  std::vector<V1::ptr> v_;
+};
+
+// The first reference to an object carries the stored classes so the object is
+// loaded without enumerating the classes.
+void InlineClasses() {
+  for (auto encoding : {aether::Encoding::kFixed, aether::Encoding::kCompact}) {
+    std::map<std::pair<aether::ObjId, uint32_t>, std::vector<uint8_t>> states;
+    int enumerated = 0;
+    auto attach = [&](aether::Domain& domain) {
+      domain.encoding_ = encoding;
+      domain.store_facility_ = [&states](const aether::Domain&,
+                                         const aether::ObjId& obj_id,
+                                         uint32_t class_id,
+                                         const AETHER_OMSTREAM& os) {
+        states[{obj_id, class_id}].assign(os.stream_.begin(), os.stream_.end());
+      };
+      domain.enumerate_facility_ = [&](const aether::Domain&,
+                                       const aether::ObjId& obj_id) {
+        enumerated++;
+        std::vector<uint32_t> classes;
+        for (const auto& s : states)
+          if (s.first.first == obj_id) classes.push_back(s.first.second);
+        return classes;
+      };
+      domain.load_facility_ = [&states](const aether::Domain&,
+                                        const aether::ObjId& obj_id,
+                                        uint32_t class_id, AETHER_IMSTREAM& is) {
+        auto& s = states[{obj_id, class_id}];
+        is.stream_.borrow(s.data(), s.size());
+      };
+    };
+    auto store = [&](bool inline_classes) {
+      states.clear();
+      aether::Domain domain{nullptr};
+      attach(domain);
+      domain.inline_classes_ = inline_classes;
+      Inline_05::ptr root(domain.CreateObj(Inline_05::kClassId, 666));
+      V3::ptr v3(domain.CreateObj(V3::kClassId, 1));
+      v3->s_ = "inline";
+      root->v_.push_back(v3);
+      root->v_.push_back(v3);
+      V1::ptr unloaded(domain.CreateObj(V3::kClassId, 2));
+      unloaded.SetFlags(aether::ObjFlags::kUnloadedByDefault);
+      root->v_.push_back(unloaded);
+      root.Serialize();
+      REQUIRE(states.size() == 7);
+    };
+    auto load = [&](bool unregister) {
+      enumerated = 0;
+      aether::Domain domain{nullptr};
+      attach(domain);
+      if (unregister) domain.registry_.UnregisterClass(V3::kClassId);
+      Inline_05::ptr root;
+      root.SetId(666);
+      root.Load(&domain);
+      REQUIRE(root->v_.size() == 3);
+      REQUIRE(root->v_[0] == root->v_[1]);
+      REQUIRE(!root->v_[2]);
+      REQUIRE(root->v_[2].GetFlags() == aether::ObjFlags::kUnloadedByDefault);
+      root->v_[2].Load(&domain);
+      REQUIRE(root->v_[2]->i == 11);
+      if (unregister) {
+        REQUIRE(root->v_[0]->GetClassId() == V2::kClassId);
+      } else {
+        V3::ptr v3 = root->v_[0];
+        REQUIRE(v3->s_ == "inline");
+      }
+    };
+    store(false);
+    load(false);
+    REQUIRE(enumerated == 3);
+    store(true);
+    load(false);
+    // The root and the unloaded object are enumerated.
+    REQUIRE(enumerated == 2);
+    load(true);
+    REQUIRE(enumerated == 2);
+  }
+}
+
+// References are read into temporary pointers while loading: the referenced
+// object is released before its state is loaded.
+class Temporary_05 : public aether::Obj {
+public:
+  AETHER_OBJ(Temporary_05, aether::Obj);
+  Temporary_05() = default;
+  Temporary_05(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    if constexpr (std::is_base_of<aether::istream, T>::value) {
+      A_00::ptr a;
+      s & a;
+      // The stored object is not V1 so the loaded pointer is released.
+      V1::ptr v;
+      s & v;
+      s & i_;
+    } else {
+      s & a_ & a_ & i_;
+    }
+  }
+  A_00::ptr a_;
+  int i_ = 0;
+};
+
+void TemporaryRefs() {
+  std::filesystem::remove_all("state");
+  {
+    aether::Domain domain{nullptr};
+    domain.store_facility_ = saver;
+    Temporary_05::ptr root(domain.CreateObj(Temporary_05::kClassId, 666));
+    root->i_ = 5;
+    root->a_ = domain.CreateObj(A_00::kClassId, 1);
+    root->a_->i_ = 7;
+    root->a_->a_.push_back(domain.CreateObj(A_00::kClassId, 2));
+    root->a_->a_[0]->i_ = 8;
+    root.Serialize();
+  }
+  erased.clear();
+  {
+    aether::Domain domain{nullptr};
+    domain.load_facility_ = loader;
+    domain.enumerate_facility_ = enumerator;
+    Temporary_05::ptr root;
+    root.SetId(666);
+    root.Load(&domain);
+    REQUIRE(!!root);
+    REQUIRE(root->i_ == 5);
+    REQUIRE(!root->a_);
+    // Referenced objects are deleted once their states are loaded.
+    REQUIRE((erased == std::set{7, 8}));
+  }
+}
+
 void Versioning() {
   std::filesystem::remove_all("state");
   Versioning1();
@@ -641,6 +1536,18 @@ void Versioning() {
   LoadReference();
   Subdomain();
   SameObjDiffDomains();
+  VisitReferences();
+  PackedRecords();
+  SchemaMismatch();
+  Fingerprints();
+  PackMismatch();
+  BaselineStates();
+  Containers();
+  FilledContainers();
+  Views();
+  DirtyTracking();
+  InlineClasses();
+  TemporaryRefs();
 }
 
 
@@ -0,0 +1,982 @@
+// Copyright 2016 Aether authors. All Rights Reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//   http://www.apache.org/licenses/LICENSE-2.0
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <thread>
+#include <unordered_map>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "../../../obj/async_store.h"
+#include "../../../obj/obj.h"
+#include "../../../obj/parallel.h"
+#include "../../../obj/prefetch.h"
+#include <assert.h>
+#define REQUIRE assert
+
+// Allocations of the measured objects and containers are counted by the class
+// operator new and by the allocator.
+static std::atomic<size_t> allocations_10{0};
+
+namespace {
+
+template <typename T>
+struct CountingAllocator {
+  using value_type = T;
+  CountingAllocator() = default;
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U>&) {}
+  T* allocate(size_t n) {
+    allocations_10++;
+    return std::allocator<T>().allocate(n);
+  }
+  void deallocate(T* p, size_t n) { std::allocator<T>().deallocate(p, n); }
+  bool operator==(const CountingAllocator&) const { return true; }
+  bool operator!=(const CountingAllocator&) const { return false; }
+};
+
+// In-memory storage to measure the framework only.
+class MemStorage {
+ public:
+  using Key = std::pair<uint64_t, uint32_t>;
+  struct KeyHash {
+    size_t operator()(const Key& k) const {
+      return std::hash<uint64_t>()(k.first * 0x9e3779b97f4a7c15ull ^ k.second);
+    }
+  };
+  std::unordered_map<Key, std::vector<uint8_t>, KeyHash> blobs_;
+  std::unordered_map<aether::ObjId, std::vector<uint32_t>, aether::ObjId::Hash>
+      classes_;
+  std::unordered_map<aether::ObjId, std::vector<uint8_t>, aether::ObjId::Hash>
+      records_;
+
+  void Attach(aether::Domain& domain, bool packed) {
+    if (packed) {
+      domain.store_object_facility_ = [this](const aether::Domain&,
+                                             const aether::ObjId& obj_id,
+                                             const AETHER_OMSTREAM& os) {
+        records_[obj_id].assign(os.stream_.begin(), os.stream_.end());
+      };
+      domain.load_object_facility_ = [this](const aether::Domain&,
+                                            const aether::ObjId& obj_id,
+                                            AETHER_IMSTREAM& is) {
+        auto it = records_.find(obj_id);
+        if (it == records_.end()) return;
+        is.stream_.borrow(it->second.data(), it->second.size());
+      };
+      return;
+    }
+    domain.store_facility_ = [this](const aether::Domain&,
+                                    const aether::ObjId& obj_id,
+                                    uint32_t class_id,
+                                    const AETHER_OMSTREAM& os) {
+      auto b = blobs_.emplace(Key{obj_id.GetValue(), class_id},
+                              std::vector<uint8_t>{});
+      if (b.second) classes_[obj_id].push_back(class_id);
+      b.first->second.assign(os.stream_.begin(), os.stream_.end());
+    };
+    domain.enumerate_facility_ = [this](const aether::Domain&,
+                                        const aether::ObjId& obj_id) {
+      return classes_[obj_id];
+    };
+    domain.load_facility_ = [this](const aether::Domain&,
+                                   const aether::ObjId& obj_id,
+                                   uint32_t class_id, AETHER_IMSTREAM& is) {
+      auto it = blobs_.find(Key{obj_id.GetValue(), class_id});
+      if (it == blobs_.end()) return;
+      // The blobs outlive the loading so they are read in place.
+      is.stream_.borrow(it->second.data(), it->second.size());
+    };
+  }
+};
+
+double Ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+}  // namespace
+
+static int erased_10 = 0;
+
+class Node_10 : public aether::Obj {
+public:
+  AETHER_OBJ(Node_10, aether::Obj);
+  Node_10() = default;
+  Node_10(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  ~Node_10() { erased_10++; }
+  static void* operator new(size_t size) {
+    allocations_10++;
+    return ::operator new(size);
+  }
+  static void operator delete(void* p) { ::operator delete(p); }
+  template <typename T> void Serializator(T& s) {
+    s & i_ & s_ & refs_;
+  }
+  int i_ = 0;
+  std::string s_{"node"};
+  std::vector<Node_10::ptr> refs_;
+};
+
+static const aether::ObjId kRootId{666};
+
+// Nodes form a binary tree and each node also references its parent, so the
+// graph has shared and cyclic references but a small depth.
+static std::vector<Node_10*> BuildTree(aether::Domain& domain, Node_10* root,
+                                       int n) {
+  // Raw pointers and reserved vectors: copying and releasing the pointers
+  // is not measured.
+  std::vector<Node_10*> nodes{root};
+  nodes.reserve(n);
+  root->refs_.reserve(2);
+  for (int i = 1; i < n; i++) {
+    // Sequential ids: random 32-bit ids of large graphs collide.
+    auto node = static_cast<Node_10*>(
+        domain.CreateObj(Node_10::kClassId, aether::ObjId(1000 + i)));
+    node->i_ = i;
+    node->refs_.reserve(3);
+    Node_10* parent = nodes[(i - 1) / 2];
+    parent->refs_.emplace_back(node);
+    node->refs_.emplace_back(parent);
+    nodes.push_back(node);
+  }
+  return nodes;
+}
+
+// Serialization and loading do a constant number of object table operations
+// per object. The time per object is still not constant: it is about
+// 0.7-1 us while the graph fits into the L2 cache (1k-10k objects) and about
+// 2-3 us beyond it (100k objects), where the nodes, their states and the
+// table buckets are cache misses. It doesn't grow further with the size.
+static void GraphScaling(int n, bool packed) {
+  MemStorage storage;
+  double serialize_ms, load_ms, release_ms, collect_ms;
+  {
+    aether::Domain domain{nullptr};
+    storage.Attach(domain, packed);
+    Node_10::ptr root(domain.CreateObj(Node_10::kClassId, kRootId));
+    std::vector<Node_10*> nodes = BuildTree(domain, root.ptr_, n);
+    auto start = std::chrono::steady_clock::now();
+    root.Serialize();
+    serialize_ms = Ms(start);
+
+    // Pointers to live objects released in a loop with the buffered
+    // candidates.
+    std::vector<Node_10::ptr> copies(nodes.begin(), nodes.begin() + n / 10);
+    domain.collect_threshold_ = 1024;
+    start = std::chrono::steady_clock::now();
+    copies.clear();
+    release_ms = Ms(start);
+    domain.collect_threshold_ = 1;
+    // The whole graph becomes a garbage of cyclic references.
+    erased_10 = 0;
+    start = std::chrono::steady_clock::now();
+    root = nullptr;
+    collect_ms = Ms(start);
+    REQUIRE(erased_10 == n);
+  }
+  {
+    aether::Domain domain{nullptr};
+    storage.Attach(domain, packed);
+    Node_10::ptr root;
+    root.SetId(kRootId);
+    auto start = std::chrono::steady_clock::now();
+    root.Load(&domain);
+    load_ms = Ms(start);
+    REQUIRE(!!root);
+    REQUIRE(root->refs_.size() == 2);
+    REQUIRE(root->refs_[1]->refs_[0] == root);
+  }
+  std::cout << (packed ? "packed " : "") << "objects: " << n
+            << " serialize: " << serialize_ms << " ms ("
+            << serialize_ms * 1e6 / n << " ns/obj) load: " << load_ms
+            << " ms (" << load_ms * 1e6 / n << " ns/obj) release "
+            << n / 10 << ": " << release_ms << " ms collect: " << collect_ms
+            << " ms (" << collect_ms * 1e6 / n << " ns/obj)\n";
+}
+
+// Releasing pointers to live objects of a graph one by one: each release
+// collecting the candidate's subgraph right away walks the whole graph, the
+// buffered candidates are collected once per threshold.
+static void ReleaseScaling(int n) {
+  const int releases = 100;
+  for (size_t threshold : {size_t{1}, size_t{1024}}) {
+    aether::Domain domain{nullptr};
+    Node_10::ptr root(domain.CreateObj(Node_10::kClassId, kRootId));
+    std::vector<Node_10*> nodes = BuildTree(domain, root.ptr_, n);
+    std::vector<Node_10::ptr> copies(nodes.end() - releases, nodes.end());
+    domain.collect_threshold_ = threshold;
+    auto start = std::chrono::steady_clock::now();
+    while (!copies.empty()) copies.pop_back();
+    double release_ms = Ms(start);
+    domain.collect_threshold_ = 1;
+    erased_10 = 0;
+    root = nullptr;
+    REQUIRE(erased_10 == n);
+    std::cout << "release of " << n << " objects, threshold " << threshold
+              << ": " << release_ms * 1e3 / releases << " us/release\n";
+  }
+}
+
+// The first reference of a child node is the parent.
+static int64_t SumTree(Node_10* node, bool root) {
+  int64_t sum = node->i_;
+  for (size_t i = root ? 0 : 1; i < node->refs_.size(); i++)
+    sum += SumTree(node->refs_[i].ptr_, false);
+  return sum;
+}
+
+// Loading into arenas: allocations and the traversal. A reloaded subgraph gets
+// an arena of its own which is deleted when the subgraph is unloaded, so the
+// memory doesn't grow while a long-lived root pins the first arena.
+static void ArenaLoading(int n) {
+  MemStorage storage;
+  {
+    aether::Domain domain{nullptr};
+    storage.Attach(domain, false);
+    Node_10::ptr root(domain.CreateObj(Node_10::kClassId, kRootId));
+    BuildTree(domain, root.ptr_, n);
+    root.Serialize();
+  }
+  for (bool arena : {false, true}) {
+    aether::Domain domain{nullptr};
+    storage.Attach(domain, false);
+    domain.load_arenas_ = arena;
+    Node_10::ptr root;
+    root.SetId(kRootId);
+    size_t allocations = allocations_10;
+    auto start = std::chrono::steady_clock::now();
+    root.Load(&domain);
+    double load_ms = Ms(start);
+    allocations = allocations_10 - allocations;
+    start = std::chrono::steady_clock::now();
+    int64_t sum = SumTree(root.ptr_, true);
+    double traverse_ms = Ms(start);
+    REQUIRE(sum == int64_t{n} * (n - 1) / 2);
+    aether::Arena* root_arena = root->arena_;
+    REQUIRE(!arena || root_arena->live() == static_cast<size_t>(n));
+    // The first subtree of the root is unloaded and reloaded.
+    double reload_ms = 0;
+    for (int round = 0; round < 10; round++) {
+      erased_10 = 0;
+      root->refs_[0].Unload();
+      REQUIRE(erased_10 > 0);
+      REQUIRE(!arena ||
+              root_arena->live() == static_cast<size_t>(n - erased_10));
+      start = std::chrono::steady_clock::now();
+      root->refs_[0].Load(&domain);
+      reload_ms += Ms(start);
+      REQUIRE(root->refs_[0]->arena_ != root_arena || !arena);
+    }
+    REQUIRE(SumTree(root.ptr_, true) == sum);
+    erased_10 = 0;
+    root = nullptr;
+    REQUIRE(erased_10 == n);
+    std::cout << (arena ? "arena " : "heap ") << "load: " << n
+              << " objects: " << load_ms << " ms, allocations: " << allocations
+              << ", traverse: " << traverse_ms << " ms, reload of a subtree: "
+              << reload_ms / 10 << " ms\n";
+  }
+}
+
+class Blob_10 : public aether::Obj {
+public:
+  AETHER_OBJ(Blob_10, aether::Obj);
+  Blob_10() = default;
+  Blob_10(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & strings_;
+  }
+  std::vector<std::string> strings_;
+};
+
+// A single object with a large state: the cost of reading must be linear.
+static void BlobLoading(int megabytes) {
+  MemStorage storage;
+  static const aether::ObjId kBlobId{777};
+  const int count = megabytes * 1024;
+  {
+    aether::Domain domain{nullptr};
+    storage.Attach(domain, false);
+    Blob_10::ptr blob(domain.CreateObj(Blob_10::kClassId, kBlobId));
+    blob->strings_.assign(count, std::string(1020, 'x'));
+    blob.Serialize();
+  }
+  aether::Domain domain{nullptr};
+  storage.Attach(domain, false);
+  Blob_10::ptr blob;
+  blob.SetId(kBlobId);
+  auto start = std::chrono::steady_clock::now();
+  blob.Load(&domain);
+  double load_ms = Ms(start);
+  REQUIRE(!!blob);
+  REQUIRE(blob->strings_.size() == static_cast<size_t>(count));
+  std::cout << "blob: " << megabytes << " MB load: " << load_ms << " ms\n";
+}
+
+class Link_10 : public aether::Obj {
+public:
+  AETHER_OBJ(Link_10, aether::Obj);
+  Link_10() = default;
+  Link_10(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & i_ & next_;
+  }
+  int i_ = 0;
+  Link_10::ptr next_;
+};
+
+// A linked list is serialized and loaded on a thread with a small stack.
+static void DeepChain(int n, bool packed) {
+  MemStorage storage;
+  double serialize_ms, load_ms;
+  {
+    aether::Domain domain{nullptr};
+    storage.Attach(domain, packed);
+    Link_10::ptr head(domain.CreateObj(Link_10::kClassId, kRootId));
+    Link_10* tail = head.ptr_;
+    for (int i = 1; i < n; i++) {
+      tail->next_ =
+          domain.CreateObj(Link_10::kClassId, aether::ObjId(1000 + i));
+      tail = tail->next_.ptr_;
+      tail->i_ = i;
+    }
+    auto start = std::chrono::steady_clock::now();
+    head.Serialize();
+    serialize_ms = Ms(start);
+    head = nullptr;
+  }
+  {
+    aether::Domain domain{nullptr};
+    storage.Attach(domain, packed);
+    Link_10::ptr head;
+    head.SetId(kRootId);
+    auto start = std::chrono::steady_clock::now();
+    head.Load(&domain);
+    load_ms = Ms(start);
+    int count = 0;
+    for (Link_10* l = head.ptr_; l; l = l->next_.ptr_)
+      REQUIRE(l->i_ == count++);
+    REQUIRE(count == n);
+    head = nullptr;
+  }
+  std::cout << (packed ? "packed " : "") << "chain: " << n
+            << " serialize: " << serialize_ms << " ms load: " << load_ms
+            << " ms\n";
+}
+
+static void DeepChainOnSmallStack(int n) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 256 * 1024);
+  pthread_t thread;
+  int res = pthread_create(
+      &thread, &attr,
+      [](void* p) -> void* {
+        int n = *static_cast<int*>(p);
+        DeepChain(n, false);
+        DeepChain(n, true);
+        return nullptr;
+      },
+      &n);
+  REQUIRE(res == 0);
+  pthread_join(thread, nullptr);
+  pthread_attr_destroy(&attr);
+}
+
+// Small integers, flags and short strings.
+class Record_10 : public aether::Obj {
+public:
+  AETHER_OBJ(Record_10, aether::Obj);
+  Record_10() = default;
+  Record_10(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & index_ & count_ & delta_ & big_ & mask_ & enabled_ & visible_ &
+        name_ & children_;
+  }
+  void Fill(int i) {
+    index_ = i;
+    count_ = i % 100;
+    delta_ = (i % 2 ? -1 : 1) * (i % 1000);
+    big_ = i == 0 ? std::numeric_limits<uint64_t>::max() : i;
+    mask_ = i & 7;
+    enabled_ = i & 1;
+    visible_ = i & 2;
+    name_ = "record" + std::to_string(i % 100);
+  }
+  bool Check(int i) const {
+    return index_ == static_cast<uint32_t>(i) && count_ == i % 100 &&
+           delta_ == (i % 2 ? -1 : 1) * (i % 1000) &&
+           big_ == (i == 0 ? std::numeric_limits<uint64_t>::max() : i) &&
+           mask_ == (i & 7) && enabled_ == bool(i & 1) &&
+           visible_ == bool(i & 2) &&
+           name_ == "record" + std::to_string(i % 100);
+  }
+  uint32_t index_ = 0;
+  int32_t count_ = 0;
+  int64_t delta_ = 0;
+  uint64_t big_ = 0;
+  uint8_t mask_ = 0;
+  bool enabled_ = false;
+  bool visible_ = false;
+  std::string name_;
+  std::vector<Record_10::ptr> children_;
+};
+
+// Size and throughput of the fixed and the compact encodings.
+static void CompactEncoding(int n) {
+  for (auto encoding : {aether::Encoding::kFixed, aether::Encoding::kCompact}) {
+    MemStorage storage;
+    double serialize_ms, load_ms;
+    {
+      aether::Domain domain{nullptr};
+      storage.Attach(domain, false);
+      domain.encoding_ = encoding;
+      Record_10::ptr root(domain.CreateObj(Record_10::kClassId, kRootId));
+      root->children_.reserve(n);
+      for (int i = 0; i < n; i++) {
+        auto r = static_cast<Record_10*>(
+            domain.CreateObj(Record_10::kClassId, aether::ObjId(1000 + i)));
+        r->Fill(i);
+        root->children_.emplace_back(r);
+      }
+      auto start = std::chrono::steady_clock::now();
+      root.Serialize();
+      serialize_ms = Ms(start);
+    }
+    size_t bytes = 0;
+    for (const auto& b : storage.blobs_) bytes += b.second.size();
+    {
+      aether::Domain domain{nullptr};
+      storage.Attach(domain, false);
+      domain.encoding_ = encoding;
+      Record_10::ptr root;
+      root.SetId(kRootId);
+      auto start = std::chrono::steady_clock::now();
+      root.Load(&domain);
+      load_ms = Ms(start);
+      REQUIRE(root->children_.size() == static_cast<size_t>(n));
+      for (int i = 0; i < n; i++) REQUIRE(root->children_[i]->Check(i));
+    }
+    std::cout << (encoding == aether::Encoding::kCompact ? "compact" : "fixed")
+              << " encoding: " << n << " objects " << bytes << " bytes ("
+              << double(bytes) / n << " bytes/obj) serialize: " << serialize_ms
+              << " ms load: " << load_ms << " ms\n";
+  }
+}
+
+// Appending a large stream: the vector is reallocated while the chunks of the
+// obuffer are written in place and handed to writev.
+static void BufferWriting(int megabytes) {
+  const std::string line(1020, 'x');
+  const int count = megabytes * 1024;
+  const size_t size = size_t{1020} * count;
+  size_t allocations = allocations_10;
+  auto start = std::chrono::steady_clock::now();
+  {
+    std::vector<uint8_t, CountingAllocator<uint8_t>> v;
+    for (int i = 0; i < count; i++) v.insert(v.end(), line.begin(), line.end());
+    REQUIRE(v.size() == size);
+  }
+  std::cout << "vector: " << megabytes << " MB append: " << Ms(start)
+            << " ms, allocations: " << allocations_10 - allocations << "\n";
+  // Chunks of the first buffer are taken from the pool by the second one.
+  for (int round = 0; round < 2; round++) {
+    start = std::chrono::steady_clock::now();
+    aether::obuffer b;
+    for (int i = 0; i < count; i++) b.write(line.data(), line.size());
+    double append_ms = Ms(start);
+    REQUIRE(b.size() == size);
+    start = std::chrono::steady_clock::now();
+    std::vector<iovec> iov;
+    for (const auto& s : b.segments()) {
+      iov.push_back({const_cast<void*>(s.data), s.size});
+    }
+    const char* path = "obuffer.bin";
+    int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    REQUIRE(fd >= 0);
+    size_t written = 0;
+    for (size_t i = 0; i < iov.size(); i += IOV_MAX) {
+      int n = static_cast<int>(std::min<size_t>(IOV_MAX, iov.size() - i));
+      written += static_cast<size_t>(::writev(fd, iov.data() + i, n));
+    }
+    ::close(fd);
+    std::remove(path);
+    REQUIRE(written == size);
+    std::cout << "obuffer: " << megabytes << " MB append: " << append_ms
+              << " ms, chunks: " << b.segments().size()
+              << ", writev: " << Ms(start) << " ms\n";
+  }
+}
+
+// The same trivially copyable fields serialized one by one and as a block.
+class Fields_10 : public aether::Obj {
+public:
+  AETHER_OBJ(Fields_10, aether::Obj);
+  Fields_10() = default;
+  Fields_10(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & a_ & b_ & c_ & d_ & e_ & f_ & g_ & h_ & children_;
+  }
+  int32_t a_ = 0;
+  int64_t b_ = 0;
+  double c_ = 0;
+  float d_ = 0;
+  uint16_t e_ = 0;
+  uint8_t f_ = 0;
+  uint32_t g_ = 0;
+  int64_t h_ = 0;
+  std::vector<Fields_10::ptr> children_;
+};
+
+class Packed_10 : public aether::Obj {
+public:
+  AETHER_OBJ(Packed_10, aether::Obj);
+  Packed_10() = default;
+  Packed_10(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & aether::pack(a_, b_, c_, d_, e_, f_, g_, h_) & children_;
+  }
+  int32_t a_ = 0;
+  int64_t b_ = 0;
+  double c_ = 0;
+  float d_ = 0;
+  uint16_t e_ = 0;
+  uint8_t f_ = 0;
+  uint32_t g_ = 0;
+  int64_t h_ = 0;
+  std::vector<Packed_10::ptr> children_;
+};
+
+template <typename T>
+static void FieldsLoading(int n) {
+  MemStorage storage;
+  double serialize_ms, load_ms;
+  {
+    aether::Domain domain{nullptr};
+    storage.Attach(domain, false);
+    typename T::ptr root(domain.CreateObj(T::kClassId, kRootId));
+    root->children_.reserve(n);
+    for (int i = 0; i < n; i++) {
+      auto o = static_cast<T*>(
+          domain.CreateObj(T::kClassId, aether::ObjId(1000 + i)));
+      o->a_ = -i;
+      o->b_ = int64_t{i} << 32;
+      o->c_ = i * 0.5;
+      o->d_ = i * 0.25f;
+      o->e_ = static_cast<uint16_t>(i);
+      o->f_ = static_cast<uint8_t>(i);
+      o->g_ = i;
+      o->h_ = -(int64_t{i} << 20);
+      root->children_.emplace_back(o);
+    }
+    auto start = std::chrono::steady_clock::now();
+    root.Serialize();
+    serialize_ms = Ms(start);
+  }
+  {
+    aether::Domain domain{nullptr};
+    storage.Attach(domain, false);
+    typename T::ptr root;
+    root.SetId(kRootId);
+    auto start = std::chrono::steady_clock::now();
+    root.Load(&domain);
+    load_ms = Ms(start);
+    REQUIRE(root->children_.size() == static_cast<size_t>(n));
+    for (int i = 0; i < n; i++) {
+      const T* o = root->children_[i].ptr_;
+      REQUIRE(o->a_ == -i && o->b_ == int64_t{i} << 32 && o->c_ == i * 0.5 &&
+              o->d_ == i * 0.25f && o->e_ == static_cast<uint16_t>(i) &&
+              o->f_ == static_cast<uint8_t>(i) && o->g_ == uint32_t(i) &&
+              o->h_ == -(int64_t{i} << 20));
+    }
+  }
+  std::cout << (T::kClassId == Packed_10::kClassId ? "packed" : "per-field")
+            << " fields: " << n << " objects serialize: " << serialize_ms
+            << " ms load: " << load_ms << " ms\n";
+}
+
+// Autosave of a few changed nodes: the whole graph is stored without the
+// tracking, only the changed nodes are visited with it.
+static void DirtyAutosave(int n, int changed) {
+  MemStorage storage;
+  aether::Domain domain{nullptr};
+  storage.Attach(domain, false);
+  Node_10::ptr root(domain.CreateObj(Node_10::kClassId, kRootId));
+  std::vector<Node_10*> nodes = BuildTree(domain, root.ptr_, n);
+  root.Serialize();
+  auto change = [&]() {
+    for (int i = 0; i < changed; i++) {
+      Node_10* node = nodes[static_cast<size_t>(i) * n / changed];
+      node->s_ = "changed";
+      node->MarkDirty();
+    }
+  };
+  change();
+  auto start = std::chrono::steady_clock::now();
+  root.Serialize();
+  double full_ms = Ms(start);
+
+  size_t stores = 0;
+  domain.store_facility_ = [&stores, f = domain.store_facility_](
+                               const aether::Domain& d,
+                               const aether::ObjId& obj_id, uint32_t class_id,
+                               const AETHER_OMSTREAM& os) {
+    stores++;
+    f(d, obj_id, class_id, os);
+  };
+  domain.dirty_tracking_ = true;
+  // Nothing is stored if nothing is changed.
+  root.Serialize();
+  REQUIRE(stores == 0);
+  // The allocator reclaims the memory of the full serialization with the first
+  // stores so they are not measured.
+  change();
+  root.Serialize();
+  REQUIRE(stores == static_cast<size_t>(changed));
+  stores = 0;
+  change();
+  start = std::chrono::steady_clock::now();
+  root.Serialize();
+  double dirty_ms = Ms(start);
+  REQUIRE(stores == static_cast<size_t>(changed));
+  std::cout << "autosave " << changed << " of " << n
+            << " objects: full: " << full_ms << " ms dirty: " << dirty_ms
+            << " ms\n";
+}
+
+// States appended to a log made durable with fsync: by each store on the
+// serializing thread or once per batch on the writer thread.
+static void Checkpoint(int n) {
+  const char* path = "checkpoint.log";
+  auto append = [](int fd, const aether::ObjId& obj_id, uint32_t class_id,
+                   const void* data, size_t size) {
+    uint64_t header[2] = {obj_id.GetValue(), (uint64_t{class_id} << 32) | size};
+    iovec iov[2] = {{header, sizeof(header)}, {const_cast<void*>(data), size}};
+    REQUIRE(::writev(fd, iov, 2) ==
+            static_cast<ssize_t>(sizeof(header) + size));
+  };
+  int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  REQUIRE(fd >= 0);
+  double sync_ms, async_ms, flush_ms;
+  {
+    aether::Domain domain{nullptr};
+    domain.store_facility_ = [&](const aether::Domain&,
+                                 const aether::ObjId& obj_id,
+                                 uint32_t class_id,
+                                 const AETHER_OMSTREAM& os) {
+      std::vector<uint8_t> state(os.stream_.begin(), os.stream_.end());
+      append(fd, obj_id, class_id, state.data(), state.size());
+      ::fsync(fd);
+    };
+    Node_10::ptr root(domain.CreateObj(Node_10::kClassId, kRootId));
+    BuildTree(domain, root.ptr_, n);
+    auto start = std::chrono::steady_clock::now();
+    root.Serialize();
+    sync_ms = Ms(start);
+  }
+  size_t batches = 0;
+  {
+    aether::AsyncStore store(
+        [&](std::vector<aether::AsyncStore::State>& batch) {
+          for (const auto& s : batch)
+            append(fd, s.obj_id, s.class_id, s.data.data(), s.data.size());
+          ::fsync(fd);
+          batches++;
+        });
+    aether::Domain domain{nullptr};
+    store.Attach(domain);
+    Node_10::ptr root(domain.CreateObj(Node_10::kClassId, kRootId));
+    BuildTree(domain, root.ptr_, n);
+    auto start = std::chrono::steady_clock::now();
+    root.Serialize();
+    async_ms = Ms(start);
+    store.Flush().get();
+    flush_ms = Ms(start);
+  }
+  ::close(fd);
+  std::remove(path);
+  std::cout << "checkpoint " << n << " objects: fsync per state: " << sync_ms
+            << " ms, async: " << async_ms << " ms, flushed: " << flush_ms
+            << " ms, " << batches << " fsyncs\n";
+}
+
+// The states are only counted so the serialization itself is measured.
+static void ParallelScaling(int n) {
+  aether::Domain domain{nullptr};
+  std::atomic<size_t> bytes{0};
+  domain.store_facility_ = [&bytes](const aether::Domain&,
+                                    const aether::ObjId&, uint32_t,
+                                    const AETHER_OMSTREAM& os) {
+    bytes += os.stream_.size();
+  };
+  Node_10::ptr root(domain.CreateObj(Node_10::kClassId, kRootId));
+  BuildTree(domain, root.ptr_, n);
+  auto start = std::chrono::steady_clock::now();
+  root.Serialize();
+  std::cout << "serialize " << n << " objects: " << Ms(start) << " ms";
+  const size_t expected = bytes.exchange(0);
+  const int hardware =
+      std::max(2, static_cast<int>(std::thread::hardware_concurrency()));
+  for (int threads = 1; threads <= hardware; threads *= 2) {
+    start = std::chrono::steady_clock::now();
+    aether::SerializeParallel(root, threads);
+    std::cout << ", " << threads << " threads: " << Ms(start) << " ms";
+    REQUIRE(bytes.exchange(0) == expected);
+  }
+  std::cout << "\n";
+}
+
+// Cold start from a storage with the latency of each request: the objects
+// are fetched one by one by the loading or ahead by the prefetching threads.
+static void PrefetchLoading(int n, int latency_us) {
+  MemStorage storage;
+  {
+    aether::Domain domain{nullptr};
+    storage.Attach(domain, false);
+    Node_10::ptr root(domain.CreateObj(Node_10::kClassId, kRootId));
+    BuildTree(domain, root.ptr_, n);
+    root.Serialize();
+  }
+  auto enumerate = [&storage, latency_us](const aether::Domain&,
+                                          const aether::ObjId& obj_id) {
+    std::this_thread::sleep_for(std::chrono::microseconds(latency_us));
+    return storage.classes_.at(obj_id);
+  };
+  auto load = [&storage, latency_us](const aether::Domain&,
+                                     const aether::ObjId& obj_id,
+                                     uint32_t class_id, AETHER_IMSTREAM& is) {
+    std::this_thread::sleep_for(std::chrono::microseconds(latency_us));
+    auto& b = storage.blobs_.at({obj_id.GetValue(), class_id});
+    is.stream_.borrow(b.data(), b.size());
+  };
+  double ms;
+  {
+    aether::Domain domain{nullptr};
+    domain.enumerate_facility_ = enumerate;
+    domain.load_facility_ = load;
+    Node_10::ptr root;
+    root.SetId(kRootId);
+    auto start = std::chrono::steady_clock::now();
+    root.Load(&domain);
+    ms = Ms(start);
+    REQUIRE(SumTree(root.ptr_, true) == int64_t{n} * (n - 1) / 2);
+  }
+  std::cout << "cold start " << n << " objects, " << latency_us
+            << " us latency: serial: " << ms << " ms";
+  for (int threads : {1, 4, 16}) {
+    aether::PrefetchLoader loader(enumerate, load, threads);
+    loader.discover_references_ = true;
+    aether::Domain domain{nullptr};
+    loader.Attach(domain);
+    Node_10::ptr root;
+    root.SetId(kRootId);
+    auto start = std::chrono::steady_clock::now();
+    loader.Prefetch(kRootId);
+    root.Load(&domain);
+    ms = Ms(start);
+    REQUIRE(SumTree(root.ptr_, true) == int64_t{n} * (n - 1) / 2);
+    std::cout << ", prefetch " << threads << " threads: " << ms << " ms";
+  }
+  // A request of a batch has the same latency as of a single object.
+  auto enumerate_batch =
+      [&storage, latency_us](
+          const aether::Domain&, const std::vector<aether::ObjId>& ids,
+          std::vector<std::pair<aether::ObjId, uint32_t>>& classes) {
+        std::this_thread::sleep_for(std::chrono::microseconds(latency_us));
+        for (const auto& id : ids) {
+          for (auto c : storage.classes_.at(id)) classes.emplace_back(id, c);
+        }
+      };
+  auto load_batch =
+      [&storage, latency_us](
+          const aether::Domain&,
+          const std::vector<std::pair<aether::ObjId, uint32_t>>& states,
+          std::vector<AETHER_IMSTREAM>& streams) {
+        std::this_thread::sleep_for(std::chrono::microseconds(latency_us));
+        for (size_t i = 0; i < states.size(); i++) {
+          auto& b = storage.blobs_.at(
+              {states[i].first.GetValue(), states[i].second});
+          streams[i].stream_.borrow(b.data(), b.size());
+        }
+      };
+  for (int threads : {1, 4}) {
+    aether::PrefetchLoader loader(enumerate_batch, load_batch, threads);
+    loader.discover_references_ = true;
+    aether::Domain domain{nullptr};
+    loader.Attach(domain);
+    Node_10::ptr root;
+    root.SetId(kRootId);
+    auto start = std::chrono::steady_clock::now();
+    loader.Prefetch(kRootId);
+    root.Load(&domain);
+    ms = Ms(start);
+    REQUIRE(SumTree(root.ptr_, true) == int64_t{n} * (n - 1) / 2);
+    std::cout << ", batched " << threads << " threads: " << ms << " ms";
+  }
+  std::cout << "\n";
+}
+
+// Serial cold start with the classes of the referenced objects stored inline.
+static void InlineClassesLoading(int n, int latency_us) {
+  std::cout << "inline classes " << n << " objects, " << latency_us
+            << " us latency:";
+  for (bool inline_classes : {false, true}) {
+    MemStorage storage;
+    {
+      aether::Domain domain{nullptr};
+      storage.Attach(domain, false);
+      domain.inline_classes_ = inline_classes;
+      Node_10::ptr root(domain.CreateObj(Node_10::kClassId, kRootId));
+      BuildTree(domain, root.ptr_, n);
+      root.Serialize();
+    }
+    int requests = 0;
+    aether::Domain domain{nullptr};
+    domain.enumerate_facility_ = [&](const aether::Domain&,
+                                     const aether::ObjId& obj_id) {
+      requests++;
+      std::this_thread::sleep_for(std::chrono::microseconds(latency_us));
+      return storage.classes_.at(obj_id);
+    };
+    domain.load_facility_ = [&](const aether::Domain&,
+                                const aether::ObjId& obj_id, uint32_t class_id,
+                                AETHER_IMSTREAM& is) {
+      requests++;
+      std::this_thread::sleep_for(std::chrono::microseconds(latency_us));
+      auto& b = storage.blobs_.at({obj_id.GetValue(), class_id});
+      is.stream_.borrow(b.data(), b.size());
+    };
+    Node_10::ptr root;
+    root.SetId(kRootId);
+    auto start = std::chrono::steady_clock::now();
+    root.Load(&domain);
+    double ms = Ms(start);
+    REQUIRE(SumTree(root.ptr_, true) == int64_t{n} * (n - 1) / 2);
+    std::cout << (inline_classes ? ", inline: " : " enumerated: ") << ms
+              << " ms, " << requests << " requests";
+  }
+  std::cout << "\n";
+}
+
+// Events reference the owner and the previous event. References are stored as
+// the ids or as the varint indices of the ref table.
+static void DenseRefs(int n) {
+  std::cout << "event list " << n << " objects:";
+  for (bool dense : {false, true}) {
+    MemStorage storage;
+    auto table = std::make_shared<aether::RefTable>();
+    {
+      aether::Domain domain{nullptr};
+      storage.Attach(domain, false);
+      if (dense) domain.ref_table_ = table.get();
+      Node_10::ptr root(domain.CreateObj(Node_10::kClassId, kRootId));
+      root->refs_.reserve(n);
+      Node_10* prev = root.ptr_;
+      for (int i = 0; i < n; i++) {
+        Node_10* e = root->refs_.emplace_back(
+            domain.CreateObj(Node_10::kClassId)).ptr_;
+        e->i_ = i;
+        e->refs_.reserve(2);
+        e->refs_.emplace_back(root);
+        e->refs_.emplace_back(prev);
+        prev = e;
+      }
+      root.Serialize();
+    }
+    size_t bytes = 0;
+    for (const auto& b : storage.blobs_) bytes += b.second.size();
+    aether::Domain domain{nullptr};
+    storage.Attach(domain, false);
+    if (dense) domain.load_ref_table_ = table;
+    Node_10::ptr root;
+    root.SetId(kRootId);
+    auto start = std::chrono::steady_clock::now();
+    root.Load(&domain);
+    double ms = Ms(start);
+    REQUIRE(root->refs_.back()->refs_[1]->i_ == n - 2);
+    std::cout << (dense ? ", dense: " : " ids: ") << bytes << " bytes " << ms
+              << " ms";
+  }
+  std::cout << "\n";
+}
+
+// Temporary domains are created by each serialization and collection.
+static void DomainCreation() {
+  const int count = 100000;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < count; i++) {
+    aether::Domain domain{nullptr};
+    REQUIRE(domain.IsExisting(Node_10::kClassId));
+  }
+  double ms = Ms(start);
+  std::cout << "domains: " << count << " " << ms * 1e6 / count
+            << " ns/domain\n";
+}
+
+// Objects are created concurrently in independent domains.
+static void IdGeneration(int threads) {
+  const int count = 1000000;
+  std::vector<std::vector<aether::ObjId>> ids(threads);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (auto& v : ids) {
+    workers.emplace_back([&v, count]() {
+      v.reserve(count);
+      for (int i = 0; i < count; i++)
+        v.push_back(aether::ObjId::GenerateUnique());
+    });
+  }
+  for (auto& w : workers) w.join();
+  double ms = Ms(start);
+  std::vector<aether::ObjId> all;
+  for (auto& v : ids) all.insert(all.end(), v.begin(), v.end());
+  std::sort(all.begin(), all.end());
+  auto collisions =
+      all.size() - (std::unique(all.begin(), all.end()) - all.begin());
+  // Collisions are expected with 32-bit ids only.
+  REQUIRE(sizeof(aether::ObjId::Type) < 8 || collisions == 0);
+  std::cout << "ids: " << threads << " threads " << all.size() / ms / 1000
+            << " M ids/s, collisions: " << collisions << "\n";
+}
+
+void Benchmark() {
+  DomainCreation();
+  for (int threads : {1, 2, 4, 8}) IdGeneration(threads);
+  for (int n : {1000, 10000, 100000}) {
+    GraphScaling(n, false);
+    GraphScaling(n, true);
+  }
+  for (int n : {250, 2000, 16000}) ReleaseScaling(n);
+  for (int mb : {1, 8, 32}) BlobLoading(mb);
+  for (int mb : {1, 32}) BufferWriting(mb);
+  ArenaLoading(100000);
+  DeepChainOnSmallStack(100000);
+  CompactEncoding(100000);
+  FieldsLoading<Fields_10>(100000);
+  FieldsLoading<Packed_10>(100000);
+  DirtyAutosave(100000, 10);
+  Checkpoint(10000);
+  ParallelScaling(200000);
+  PrefetchLoading(2000, 100);
+  InlineClassesLoading(2000, 100);
+  DenseRefs(100000);
+}
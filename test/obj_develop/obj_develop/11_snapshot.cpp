@@ -0,0 +1,275 @@
+// Copyright 2016 Aether authors. All Rights Reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//   http://www.apache.org/licenses/LICENSE-2.0
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include "../../../obj/snapshot.h"
+#include <assert.h>
+#define REQUIRE assert
+
+// Loaded objects with a negative i_ drop their references.
+static bool drop_refs_11 = false;
+
+class Base_11 : public aether::Obj {
+public:
+  AETHER_OBJ(Base_11, aether::Obj);
+  Base_11() = default;
+  Base_11(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & i_ & refs_;
+    if (drop_refs_11 && i_ < 0) refs_.clear();
+  }
+  int i_ = 0;
+  std::vector<Base_11::ptr> refs_;
+};
+
+class Derived_11 : public Base_11 {
+public:
+  AETHER_OBJ(Derived_11, Base_11);
+  Derived_11() = default;
+  Derived_11(Obj* parent, aether::Domain* domain) : Base_11(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & s_;
+  }
+  std::string s_;
+};
+
+class View_11 : public aether::Obj {
+public:
+  AETHER_OBJ(View_11, aether::Obj);
+  View_11() = default;
+  View_11(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & name_;
+  }
+  std::string_view name_;
+};
+
+void Snapshot() {
+  const char* path = "snapshot.bin";
+  {
+    aether::Domain domain{nullptr};
+    aether::SnapshotWriter writer;
+    writer.Attach(domain);
+    Base_11::ptr root(domain.CreateObj(Base_11::kClassId, 666));
+    root->i_ = 666;
+    Derived_11::ptr d(domain.CreateObj(Derived_11::kClassId, 1));
+    d->i_ = 1;
+    d->s_ = "derived";
+    root->refs_.push_back(d);
+    d->refs_.push_back(root);
+    root->refs_.emplace_back(domain.CreateObj(Base_11::kClassId, 2))->i_ = 2;
+    root.Serialize();
+    REQUIRE(writer.Write(path));
+  }
+  {
+    aether::SnapshotReader reader;
+    REQUIRE(!reader.Open("missing.bin"));
+    REQUIRE(reader.Open(path));
+    // Base_11 is created as the most derived Derived_11 so each object has two
+    // classes.
+    REQUIRE(reader.size() == 6);
+    REQUIRE(reader.Enumerate(1).size() == 2);
+    REQUIRE(reader.Enumerate(3).empty());
+
+    aether::Domain domain{nullptr};
+    reader.Attach(domain);
+    Base_11::ptr root;
+    root.SetId(666);
+    root.Load(&domain);
+    REQUIRE(!!root);
+    REQUIRE(root->i_ == 666);
+    REQUIRE(root->refs_.size() == 2);
+    Derived_11::ptr d = root->refs_[0];
+    REQUIRE(!!d);
+    REQUIRE(d->i_ == 1);
+    REQUIRE(d->s_ == "derived");
+    REQUIRE(d->refs_[0] == root);
+    REQUIRE(root->refs_[1]->i_ == 2);
+
+    Base_11::ptr missing;
+    missing.SetId(3);
+    missing.Load(&domain);
+    REQUIRE(!missing);
+  }
+  std::remove(path);
+
+  // Views into the mapping keep it mapped after the reader is destroyed.
+  {
+    aether::Domain domain{nullptr};
+    aether::SnapshotWriter writer;
+    writer.Attach(domain);
+    View_11::ptr v(domain.CreateObj(View_11::kClassId, 7));
+    v->name_ = "mapped";
+    v.Serialize();
+    REQUIRE(writer.Write(path));
+  }
+  {
+    aether::Domain domain{nullptr};
+    View_11::ptr v;
+    {
+      aether::SnapshotReader reader;
+      REQUIRE(reader.Open(path));
+      reader.Attach(domain);
+      v.SetId(7);
+      v.Load(&domain);
+      reader.Detach(domain);
+    }
+    std::remove(path);
+    REQUIRE(v->name_ == "mapped");
+  }
+
+  // Events reference the owner. The references are stored as the indices of
+  // the snapshot's ref table.
+  auto write = [](const char* path, bool dense_refs) {
+    aether::Domain domain{nullptr};
+    aether::SnapshotWriter writer(dense_refs);
+    writer.Attach(domain);
+    Base_11::ptr root(domain.CreateObj(Base_11::kClassId, 666));
+    for (int i = 1; i <= 100; i++) {
+      Base_11::ptr e(domain.CreateObj(Base_11::kClassId, 1000 + i));
+      e->i_ = i;
+      e->refs_.push_back(root);
+      e->refs_.push_back(root);
+      root->refs_.push_back(e);
+    }
+    root->refs_.emplace_back();
+    root.Serialize();
+    REQUIRE(writer.Write(path));
+    std::ifstream f(path, std::ios::in | std::ios::binary | std::ios::ate);
+    return static_cast<size_t>(f.tellg());
+  };
+  const char* ids_path = "snapshot_ids.bin";
+  const char* dense_path = "snapshot_dense.bin";
+  const size_t ids_size = write(ids_path, false);
+  const size_t dense_size = write(dense_path, true);
+  REQUIRE(dense_size < ids_size);
+  {
+    aether::SnapshotReader ids;
+    REQUIRE(ids.Open(ids_path));
+    aether::SnapshotReader reader;
+    REQUIRE(reader.Open(dense_path));
+    REQUIRE(reader.size() == ids.size());
+    REQUIRE(reader.Enumerate(1001).size() == 2);
+
+    aether::Domain domain{nullptr};
+    reader.Attach(domain);
+    REQUIRE(domain.load_ref_table_);
+    Base_11::ptr root;
+    root.SetId(666);
+    root.Load(&domain);
+    REQUIRE(!!root);
+    REQUIRE(root->refs_.size() == 101);
+    REQUIRE(!root->refs_[100]);
+    for (int i = 0; i < 100; i++) {
+      const Base_11::ptr& e = root->refs_[i];
+      REQUIRE(e.GetId() == aether::ObjId(1001 + i));
+      REQUIRE(e->i_ == i + 1);
+      REQUIRE(e->refs_[0] == root);
+      REQUIRE(e->refs_[1] == root);
+    }
+    // Objects resolved by the indices are dropped from the slots when
+    // deleted, so the graph is loaded again.
+    root = nullptr;
+    root.SetId(666);
+    root.Load(&domain);
+    REQUIRE(root->refs_[99]->refs_[0] == root);
+    REQUIRE(root->refs_[99]->i_ == 100);
+
+    // Objects are loaded by the ids outside the graph.
+    aether::Domain other{nullptr};
+    reader.Attach(other);
+    Base_11::ptr e;
+    e.SetId(1050);
+    e.Load(&other);
+    REQUIRE(e->i_ == 50);
+    REQUIRE(e->refs_[0]->refs_[49] == e);
+    reader.Detach(other);
+    REQUIRE(!other.load_ref_table_);
+    REQUIRE(!other.enumerate_facility_);
+
+    // The table outlives the snapshot and the loaded graph is stored with the
+    // ids.
+    reader.Close();
+    REQUIRE(domain.load_ref_table_->Id(1).IsValid());
+    REQUIRE(!domain.ref_table_);
+    std::map<std::pair<aether::ObjId, uint32_t>, std::vector<uint8_t>> states;
+    domain.store_facility_ = [&states](const aether::Domain&,
+                                       const aether::ObjId& obj_id,
+                                       uint32_t class_id,
+                                       const AETHER_OMSTREAM& os) {
+      states[{obj_id, class_id}].assign(os.stream_.begin(), os.stream_.end());
+    };
+    root.Serialize();
+    // Each object is stored with the two classes of Derived_11.
+    REQUIRE(states.size() == 2 * 101);
+    aether::Domain copy{nullptr};
+    copy.enumerate_facility_ = [&states](const aether::Domain&,
+                                         const aether::ObjId& obj_id) {
+      std::vector<uint32_t> classes;
+      for (const auto& st : states) {
+        if (st.first.first == obj_id) classes.push_back(st.first.second);
+      }
+      return classes;
+    };
+    copy.load_facility_ = [&states](const aether::Domain&,
+                                    const aether::ObjId& obj_id,
+                                    uint32_t class_id, AETHER_IMSTREAM& is) {
+      const auto& st = states.at({obj_id, class_id});
+      is.stream_.borrow(st.data(), st.size());
+    };
+    Base_11::ptr loaded;
+    loaded.SetId(666);
+    loaded.Load(&copy);
+    REQUIRE(loaded->refs_.size() == 101);
+    REQUIRE(loaded->refs_[49]->i_ == 50);
+    REQUIRE(loaded->refs_[49]->refs_[0] == loaded);
+  }
+  std::remove(ids_path);
+
+  // The object dropped by the first referencing object is loaded before the
+  // second one resolves the same index.
+  {
+    aether::Domain domain{nullptr};
+    aether::SnapshotWriter writer(true);
+    writer.Attach(domain);
+    Base_11::ptr root(domain.CreateObj(Base_11::kClassId, 666));
+    Base_11::ptr a(domain.CreateObj(Base_11::kClassId, 1001));
+    Base_11::ptr b(domain.CreateObj(Base_11::kClassId, 1002));
+    Base_11::ptr t(domain.CreateObj(Base_11::kClassId, 1003));
+    a->i_ = -1;
+    t->i_ = 3;
+    a->refs_.push_back(t);
+    b->refs_.push_back(t);
+    root->refs_.push_back(b);
+    root->refs_.push_back(a);
+    root.Serialize();
+    REQUIRE(writer.Write(dense_path));
+  }
+  {
+    aether::SnapshotReader reader;
+    REQUIRE(reader.Open(dense_path));
+    aether::Domain domain{nullptr};
+    reader.Attach(domain);
+    drop_refs_11 = true;
+    Base_11::ptr root;
+    root.SetId(666);
+    root.Load(&domain);
+    drop_refs_11 = false;
+    REQUIRE(root->refs_[1]->refs_.empty());
+    REQUIRE(root->refs_[0]->refs_[0]->i_ == 3);
+    REQUIRE(domain.Find(1003) == root->refs_[0]->refs_[0].ptr_);
+  }
+  std::remove(dense_path);
+}
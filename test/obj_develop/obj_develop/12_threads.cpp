@@ -0,0 +1,424 @@
+// Copyright 2016 Aether authors. All Rights Reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//   http://www.apache.org/licenses/LICENSE-2.0
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include "../../../obj/parallel.h"
+#include "../../../obj/prefetch.h"
+#include <assert.h>
+#define REQUIRE assert
+
+static thread_local int erased_12 = 0;
+static thread_local int created_12 = 0;
+
+class Node_12 : public aether::Obj {
+public:
+  AETHER_OBJ(Node_12, aether::Obj);
+  Node_12() { created_12++; }
+  Node_12(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {
+    created_12++;
+  }
+  ~Node_12() { erased_12++; }
+  template <typename T> void Serializator(T& s) {
+    s & i_ & refs_;
+  }
+  int i_ = 0;
+  std::vector<Node_12::ptr> refs_;
+};
+
+class View_12 : public aether::Obj {
+public:
+  AETHER_OBJ(View_12, aether::Obj);
+  View_12() = default;
+  View_12(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & name_;
+  }
+  std::string_view name_;
+};
+
+// Each thread creates, stores, loads and releases cyclic graphs in its own
+// domains.
+static void DomainWorker(int seed, std::atomic<int>& failures) {
+  std::map<std::pair<aether::ObjId, uint32_t>, std::vector<uint8_t>> states;
+  std::map<aether::ObjId, std::vector<uint32_t>> classes;
+  for (int iteration = 0; iteration < 20; iteration++) {
+    const int n = 50 + (seed * 7 + iteration) % 50;
+    erased_12 = 0;
+    states.clear();
+    classes.clear();
+    {
+      aether::Domain domain{nullptr};
+      domain.store_facility_ = [&](const aether::Domain&,
+                                   const aether::ObjId& obj_id,
+                                   uint32_t class_id,
+                                   const AETHER_OMSTREAM& os) {
+        classes[obj_id].push_back(class_id);
+        states[{obj_id, class_id}].assign(os.stream_.begin(),
+                                          os.stream_.end());
+      };
+      Node_12::ptr root(domain.CreateObj(Node_12::kClassId, 666));
+      Node_12::ptr prev = root;
+      for (int i = 1; i < n; i++) {
+        Node_12::ptr node(domain.CreateObj(Node_12::kClassId));
+        node->i_ = i;
+        node->refs_.push_back(root);
+        prev->refs_.push_back(node);
+        prev = node;
+      }
+      prev = nullptr;
+      root.Serialize();
+      root = nullptr;
+      if (erased_12 != n) failures++;
+    }
+    erased_12 = 0;
+    {
+      aether::Domain domain{nullptr};
+      domain.enumerate_facility_ = [&](const aether::Domain&,
+                                       const aether::ObjId& obj_id) {
+        return classes[obj_id];
+      };
+      domain.load_facility_ = [&](const aether::Domain&,
+                                  const aether::ObjId& obj_id,
+                                  uint32_t class_id, AETHER_IMSTREAM& is) {
+        auto& s = states[{obj_id, class_id}];
+        is.stream_.borrow(s.data(), s.size());
+      };
+      Node_12::ptr root;
+      root.SetId(666);
+      root.Load(&domain);
+      int count = 0;
+      // Each node references the root and then the next node.
+      for (Node_12* node = root.ptr_; node && count <= n;
+           node = node->refs_.back() == root ? nullptr
+                                             : node->refs_.back().ptr_) {
+        if (node->i_ != count) failures++;
+        count++;
+      }
+      if (count != n) failures++;
+      root = nullptr;
+      if (erased_12 != n) failures++;
+    }
+  }
+}
+
+using States_12 =
+    std::map<std::pair<aether::ObjId, uint32_t>, std::vector<uint8_t>>;
+
+// Nodes reference random earlier nodes so the graph has shared references
+// and cycles through the root.
+static std::vector<Node_12::ptr> BuildGraph(aether::Domain& domain, int n) {
+  std::vector<Node_12::ptr> nodes;
+  nodes.emplace_back(domain.CreateObj(Node_12::kClassId, 666));
+  uint32_t random = 1;
+  auto next = [&random](int range) {
+    random = random * 1103515245u + 12345u;
+    return (random >> 8) % range;
+  };
+  for (int i = 1; i < n; i++) {
+    Node_12::ptr node(domain.CreateObj(Node_12::kClassId, 1000 + i));
+    node->i_ = i;
+    nodes[next(i)]->refs_.push_back(node);
+    nodes[next(i)]->refs_.push_back(node);
+    node->refs_.push_back(nodes[0]);
+    nodes.push_back(node);
+  }
+  return nodes;
+}
+
+// Class states stored by the parallel serialization are the same as stored by
+// Ptr::Serialize and each object is stored once.
+static void ParallelSerialization() {
+  using States = States_12;
+  aether::Domain domain{nullptr};
+  std::mutex mutex;
+  States states;
+  size_t stores = 0;
+  domain.store_facility_ = [&](const aether::Domain&,
+                               const aether::ObjId& obj_id, uint32_t class_id,
+                               const AETHER_OMSTREAM& os) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stores++;
+    states[{obj_id, class_id}].assign(os.stream_.begin(), os.stream_.end());
+  };
+  const int n = 2000;
+  std::vector<Node_12::ptr> nodes = BuildGraph(domain, n);
+  Node_12::ptr root = nodes[0];
+  root.Serialize();
+  REQUIRE(stores == n);
+  const States expected = std::move(states);
+  for (int threads : {1, 2, 4, 8}) {
+    states.clear();
+    stores = 0;
+    aether::SerializeParallel(root, threads);
+    REQUIRE(stores == n);
+    REQUIRE(states == expected);
+  }
+
+  // Only changed objects are stored with the dirty tracking.
+  domain.dirty_tracking_ = true;
+  nodes[n / 2]->i_ = -1;
+  nodes[n / 2]->MarkDirty();
+  nodes[n - 1]->MarkDirty();
+  states.clear();
+  stores = 0;
+  aether::SerializeParallel(root, 4);
+  REQUIRE(stores == 2);
+  REQUIRE(!nodes[n / 2]->IsDirty());
+  REQUIRE(states.size() == 2);
+
+  // The states depending on the order of the objects are not stored.
+  domain.inline_classes_ = true;
+  bool thrown = false;
+  try {
+    aether::SerializeParallel(root, 4);
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  REQUIRE(thrown);
+  for (auto& node : nodes) node->refs_.clear();
+}
+
+// The prefetched graph is the same as the stored one and each object is
+// fetched once.
+// Fetched states are owned by the loading domain so the views of the loaded
+// objects outlive the loader.
+static void PrefetchedViews() {
+  States_12 states;
+  {
+    aether::Domain domain{nullptr};
+    domain.store_facility_ = [&](const aether::Domain&,
+                                 const aether::ObjId& obj_id,
+                                 uint32_t class_id,
+                                 const AETHER_OMSTREAM& os) {
+      states[{obj_id, class_id}].assign(os.stream_.begin(), os.stream_.end());
+    };
+    View_12::ptr o(domain.CreateObj(View_12::kClassId, 7));
+    o->name_ = "prefetched";
+    o.Serialize();
+  }
+  auto enumerate = [](const aether::Domain&, const aether::ObjId&) {
+    return std::vector<uint32_t>{View_12::kClassId};
+  };
+  auto load = [&states](const aether::Domain&, const aether::ObjId& obj_id,
+                        uint32_t class_id, AETHER_IMSTREAM& is) {
+    is.stream_ = std::vector<uint8_t>(states[{obj_id, class_id}]);
+  };
+  aether::Domain domain{nullptr};
+  View_12::ptr o;
+  o.SetId(7);
+  {
+    aether::PrefetchLoader loader(enumerate, load, 2);
+    loader.Attach(domain);
+    loader.Prefetch(7);
+    o.Load(&domain);
+    // The state taken by the first loading is loaded again.
+    o.Unload();
+    o.Load(&domain);
+  }
+  REQUIRE(!!o);
+  REQUIRE(o->name_ == "prefetched");
+}
+
+static void PrefetchLoading() {
+  const int n = 2000;
+  States_12 states;
+  std::vector<int> expected;
+  {
+    aether::Domain domain{nullptr};
+    domain.store_facility_ = [&](const aether::Domain&,
+                                 const aether::ObjId& obj_id,
+                                 uint32_t class_id,
+                                 const AETHER_OMSTREAM& os) {
+      states[{obj_id, class_id}].assign(os.stream_.begin(), os.stream_.end());
+    };
+    std::vector<Node_12::ptr> nodes = BuildGraph(domain, n);
+    nodes[0].Serialize();
+    for (auto& node : nodes) {
+      for (auto& r : node->refs_) expected.push_back(r->i_);
+      node->refs_.clear();
+    }
+  }
+  std::mutex mutex;
+  std::map<aether::ObjId, int> enumerated;
+  auto enumerate = [&](const aether::Domain&, const aether::ObjId& obj_id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    enumerated[obj_id]++;
+    return std::vector<uint32_t>{Node_12::kClassId};
+  };
+  auto load = [&states](const aether::Domain&, const aether::ObjId& obj_id,
+                        uint32_t class_id, AETHER_IMSTREAM& is) {
+    auto it = states.find({obj_id, class_id});
+    if (it == states.end()) throw std::runtime_error("missing state");
+    is.stream_.borrow(it->second.data(), it->second.size());
+  };
+  for (auto [threads, batch_size] : {std::pair<int, size_t>{1, 1}, {4, 1},
+                                     {4, 16}}) {
+    enumerated.clear();
+    aether::PrefetchLoader loader(enumerate, load, threads, batch_size);
+    loader.discover_references_ = true;
+    aether::Domain domain{nullptr};
+    loader.Attach(domain);
+    loader.Prefetch(666);
+    Node_12::ptr root;
+    root.SetId(666);
+    root.Load(&domain);
+    REQUIRE(!!root);
+    REQUIRE(enumerated.size() == n);
+    for (const auto& e : enumerated) REQUIRE(e.second == 1);
+    // Nodes are compared in the order of the ids.
+    std::vector<Node_12::ptr> nodes;
+    std::vector<int> loaded;
+    for (int i = 0; i < n; i++) {
+      nodes.emplace_back(domain.Find(i == 0 ? 666 : 1000 + i));
+      for (auto& r : nodes.back()->refs_) loaded.push_back(r->i_);
+    }
+    REQUIRE(loaded == expected);
+    for (auto& node : nodes) node->refs_.clear();
+  }
+
+  // Objects are requested in batches.
+  size_t batches = 0;
+  auto enumerate_batch = [&](const aether::Domain&,
+                             const std::vector<aether::ObjId>& ids,
+                             std::vector<std::pair<aether::ObjId, uint32_t>>&
+                                 classes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    batches++;
+    // Classes are appended in any order.
+    for (auto id = ids.rbegin(); id != ids.rend(); ++id) {
+      enumerated[*id]++;
+      classes.emplace_back(*id, Node_12::kClassId);
+    }
+  };
+  auto load_batch = [&](const aether::Domain& domain,
+                        const std::vector<std::pair<aether::ObjId, uint32_t>>&
+                            keys,
+                        std::vector<AETHER_IMSTREAM>& streams) {
+    for (size_t i = 0; i < keys.size(); i++)
+      load(domain, keys[i].first, keys[i].second, streams[i]);
+  };
+  for (auto [threads, batch_size] :
+       {std::pair<int, size_t>{0, 0}, {1, 1}, {1, 256}, {4, 256}}) {
+    enumerated.clear();
+    batches = 0;
+    aether::Domain domain{nullptr};
+    std::unique_ptr<aether::PrefetchLoader> loader;
+    if (threads == 0) {
+      // The domain requests the objects one by one.
+      domain.enumerate_batch_facility_ = enumerate_batch;
+      domain.load_batch_facility_ = load_batch;
+    } else {
+      loader = std::make_unique<aether::PrefetchLoader>(
+          enumerate_batch, load_batch, threads, batch_size);
+      loader->discover_references_ = true;
+      loader->Attach(domain);
+    }
+    Node_12::ptr root;
+    root.SetId(666);
+    root.Load(&domain);
+    REQUIRE(enumerated.size() == n);
+    for (const auto& e : enumerated) REQUIRE(e.second == 1);
+    // The frontier of the references is requested in a few batches.
+    REQUIRE(batch_size > 1 ? batches < n / 10 : batches == n);
+    std::vector<Node_12::ptr> nodes;
+    std::vector<int> loaded;
+    for (int i = 0; i < n; i++) {
+      nodes.emplace_back(domain.Find(i == 0 ? 666 : 1000 + i));
+      for (auto& r : nodes.back()->refs_) loaded.push_back(r->i_);
+    }
+    REQUIRE(loaded == expected);
+    for (auto& node : nodes) node->refs_.clear();
+  }
+
+  // Without the discovery the objects are fetched when the loading waits for
+  // them and the loaded classes are created only by the loading thread.
+  {
+    enumerated.clear();
+    aether::PrefetchLoader loader(enumerate, load, 4);
+    aether::Domain domain{nullptr};
+    loader.Attach(domain);
+    Node_12::ptr root;
+    root.SetId(666);
+    created_12 = 0;
+    root.Load(&domain);
+    REQUIRE(created_12 == n);
+    REQUIRE(enumerated.size() == n);
+    for (const auto& e : enumerated) REQUIRE(e.second == 1);
+    std::vector<Node_12::ptr> nodes;
+    for (int i = 0; i < n; i++)
+      nodes.emplace_back(domain.Find(i == 0 ? 666 : 1000 + i));
+    for (auto& node : nodes) node->refs_.clear();
+  }
+
+  // The storage error is thrown by the loading.
+  states.erase({aether::ObjId{1000 + n / 2}, Node_12::kClassId});
+  aether::PrefetchLoader loader(enumerate, load, 4);
+  aether::Domain domain{nullptr};
+  loader.Attach(domain);
+  Node_12::ptr root;
+  root.SetId(666);
+  bool thrown = false;
+  try {
+    root.Load(&domain);
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  REQUIRE(thrown);
+  PrefetchedViews();
+}
+
+// Candidates are kept by the domain so an object released by one thread and
+// deleted by another is removed from the candidates it was added to.
+static void CrossThreadRelease() {
+  aether::Domain domain{nullptr};
+  domain.collect_threshold_ = 1024;
+  Node_12::ptr a(domain.CreateObj(Node_12::kClassId, 1));
+  Node_12::ptr b(domain.CreateObj(Node_12::kClassId, 2));
+  b->refs_.push_back(b);
+  Node_12::ptr a2 = a;
+  Node_12::ptr b2 = b;
+  std::thread([&a2, &b2] {
+    a2 = nullptr;
+    b2 = nullptr;
+  }).join();
+  REQUIRE(domain.release_candidates_.size() == 2);
+  int erased = 0;
+  std::thread([&domain, &a, &b, &erased] {
+    a = nullptr;
+    // The buffered cycle is collected with the release reaching the threshold.
+    domain.collect_threshold_ = 1;
+    b = nullptr;
+    erased = erased_12;
+  }).join();
+  REQUIRE(erased == 2);
+  REQUIRE(domain.release_candidates_.empty());
+}
+
+void Threads() {
+  const int kThreads = 8;
+  std::atomic<int> failures{0};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; i++)
+    threads.emplace_back(DomainWorker, i, std::ref(failures));
+  for (auto& t : threads) t.join();
+  REQUIRE(failures == 0);
+  CrossThreadRelease();
+  ParallelSerialization();
+  PrefetchLoading();
+}
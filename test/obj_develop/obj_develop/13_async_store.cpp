@@ -0,0 +1,120 @@
+// Copyright 2016 Aether authors. All Rights Reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//   http://www.apache.org/licenses/LICENSE-2.0
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <stdexcept>
+#include <thread>
+#include "../../../obj/async_store.h"
+#include <assert.h>
+#define REQUIRE assert
+
+class Node_13 : public aether::Obj {
+public:
+  AETHER_OBJ(Node_13, aether::Obj);
+  Node_13() = default;
+  Node_13(Obj* parent, aether::Domain* domain) : Obj(parent, domain) {}
+  template <typename T> void Serializator(T& s) {
+    s & i_ & refs_;
+  }
+  int i_ = 0;
+  std::vector<Node_13::ptr> refs_;
+};
+
+using States_13 =
+    std::map<std::pair<aether::ObjId, uint32_t>, std::vector<uint8_t>>;
+
+static Node_13::ptr LoadRoot(aether::Domain& domain, States_13& states) {
+  domain.enumerate_facility_ = [](const aether::Domain&,
+                                  const aether::ObjId&) {
+    return std::vector<uint32_t>{Node_13::kClassId};
+  };
+  domain.load_facility_ = [&states](const aether::Domain&,
+                                    const aether::ObjId& obj_id,
+                                    uint32_t class_id, AETHER_IMSTREAM& is) {
+    auto it = states.find({obj_id, class_id});
+    if (it != states.end()) is.stream_ = std::vector<uint8_t>(it->second);
+  };
+  Node_13::ptr root;
+  root.SetId(666);
+  root.Load(&domain);
+  return root;
+}
+
+void AsyncStore() {
+  const int n = 10;
+  States_13 states;
+  int batches = 0;
+  bool fail = false;
+  std::promise<void> gate;
+  std::shared_future<void> opened = gate.get_future().share();
+  {
+    aether::AsyncStore store(
+        [&](std::vector<aether::AsyncStore::State>& batch) {
+          opened.wait();
+          batches++;
+          if (fail) throw std::runtime_error("write failed");
+          for (auto& s : batch)
+            states[{s.obj_id, s.class_id}] = std::move(s.data);
+        },
+        2);
+    REQUIRE(store.Flush().wait_for(std::chrono::seconds(0)) ==
+            std::future_status::ready);
+
+    aether::Domain domain{nullptr};
+    store.Attach(domain);
+    Node_13::ptr root(domain.CreateObj(Node_13::kClassId, 666));
+    for (int i = 1; i < n; i++)
+      root->refs_.emplace_back(domain.CreateObj(Node_13::kClassId, i))->i_ = i;
+
+    // The serialization is blocked by the full queue while the writer waits.
+    std::atomic<bool> serialized{false};
+    std::thread t([&]() {
+      root.Serialize();
+      serialized = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    REQUIRE(!serialized);
+    gate.set_value();
+    t.join();
+    store.Flush().get();
+    REQUIRE(states.size() == n);
+    // States are queued while the writer is busy so they are batched.
+    REQUIRE(batches < n);
+
+    fail = true;
+    root->i_ = 1;
+    root.Serialize();
+    bool thrown = false;
+    try {
+      store.Flush().get();
+    } catch (const std::runtime_error&) {
+      thrown = true;
+    }
+    REQUIRE(thrown);
+    fail = false;
+    root.Serialize();
+    store.Flush().get();
+    aether::Domain loaded{nullptr};
+    REQUIRE(LoadRoot(loaded, states)->i_ == 1);
+
+    // Queued states are written on destruction.
+    root->i_ = 2;
+    root.Serialize();
+  }
+  aether::Domain domain{nullptr};
+  Node_13::ptr root = LoadRoot(domain, states);
+  REQUIRE(root->i_ == 2);
+  REQUIRE(root->refs_.size() == n - 1);
+  REQUIRE(root->refs_[n - 2]->i_ == n - 1);
+}
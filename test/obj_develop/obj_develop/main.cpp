@@ -23,8 +23,16 @@ extern void Versioning();
 extern void Graph();
 extern void AppRun();
 extern void Loadable();
+extern void Benchmark();
+extern void Snapshot();
+extern void Threads();
+extern void AsyncStore();
 
 int main(int argc, const char * argv[]) {
   Versioning();
+  Snapshot();
+  Threads();
+  AsyncStore();
+  Benchmark();
   return 0;
 }